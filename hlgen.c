@@ -0,0 +1,231 @@
+/***
+ * hlgen.c
+ * Generates hltables.h, the syntax highlighting tables of kilo.c
+ ***/
+
+/* hlgen compiles the language definitions below into the tables kilo's
+ * lexer runs on and writes them to stdout as C; the Makefile runs it to
+ * produce hltables.h. Per language it emits a 256-entry table of the
+ * hlClass bits of every byte and a perfect hash table of its keywords, so
+ * the lexer classifies a byte with one load and looks a word up with one
+ * hash and one memcmp().
+ */
+
+/*** includes ***/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*** languages ***/
+
+struct language {
+    char *filetype;
+    char *filematch[8];
+    char *keywords[128]; //keywords ending in | are types, highlighted as KEYWORD2
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    char *flags;
+};
+
+struct language languages[] = {
+    {
+        "c",
+        { ".c", ".h", ".cpp", NULL },
+        {
+            "switch", "if", "while", "for", "break", "continue", "return", "else",
+            "struct", "union", "typedef", "static", "enum", "class", "case", "do",
+            "goto", "default", "sizeof", "const", "volatile", "extern", "inline",
+
+            "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+            "void|", "short|", "size_t|", NULL
+        },
+        "//", "/*", "*/",
+        "HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS"
+    },
+};
+
+#define LANGUAGES (sizeof(languages) / sizeof(languages[0]))
+
+//The perfect hash emitKeywords() found for a language.
+struct keywordTable {
+    unsigned mask, seed;
+    int min, max; //shortest and longest keyword
+};
+
+/*** classes ***/
+
+enum hlClass {
+    HLC_SEPARATOR = 1, //ends a word
+    HLC_DIGIT = 2,
+    HLC_QUOTE = 4,     //starts a string
+    HLC_COMMENT = 8,   //first byte of a comment delimiter
+    HLC_KEYWORD = 16   //first byte of a keyword
+};
+
+int isSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+void emitClasses(struct language *l) {
+    unsigned char cls[256] = {0};
+    for (int c = 0; c < 256; c++) {
+        if (isSeparator(c)) cls[c] |= HLC_SEPARATOR;
+        if (c >= '0' && c <= '9') cls[c] |= HLC_DIGIT;
+        if (c == '"' || c == '\'') cls[c] |= HLC_QUOTE;
+    }
+    if (l->singleline_comment_start)
+        cls[(unsigned char)l->singleline_comment_start[0]] |= HLC_COMMENT;
+    if (l->multiline_comment_start && l->multiline_comment_end)
+        cls[(unsigned char)l->multiline_comment_start[0]] |= HLC_COMMENT;
+    for (int j = 0; l->keywords[j]; j++)
+        cls[(unsigned char)l->keywords[j][0]] |= HLC_KEYWORD;
+
+    printf("unsigned char HL_%s_classes[256] = {", l->filetype);
+    for (int c = 0; c < 256; c++)
+        printf("%s%2d,", c % 16 ? " " : "\n    ", cls[c]);
+    printf("\n};\n\n");
+}
+
+/*** keywords ***/
+
+//Emitted into the tables as well, so the editor hashes exactly like this.
+#define KEYWORD_HASH \
+    "unsigned editorKeywordHash(const char *s, int len, unsigned seed) {\n" \
+    "    unsigned h = seed;\n" \
+    "    for (int j = 0; j < len; j++) h = (h ^ (unsigned char)s[j]) * 16777619u;\n" \
+    "    return h ^ (h >> 15);\n" \
+    "}\n"
+
+unsigned keywordHash(const char *s, int len, unsigned seed) {
+    unsigned h = seed;
+    for (int j = 0; j < len; j++) h = (h ^ (unsigned char)s[j]) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+int keywordLen(const char *kw) {
+    int len = strlen(kw);
+    return kw[len - 1] == '|' ? len - 1 : len;
+}
+
+/* findSeed() looks for a seed that sends every keyword to its own slot of a
+ * table of mask + 1 slots. Returns 0 if there is none among the first tries.
+ */
+int findSeed(struct language *l, unsigned mask, unsigned *seed) {
+    char *used = malloc(mask + 1);
+    for (unsigned s = 1; s < (1u << 20); s++) {
+        memset(used, 0, mask + 1);
+        int j;
+        for (j = 0; l->keywords[j]; j++) {
+            unsigned h = keywordHash(l->keywords[j], keywordLen(l->keywords[j]), s) & mask;
+            if (used[h]) break;
+            used[h] = 1;
+        }
+        if (!l->keywords[j]) {
+            *seed = s;
+            free(used);
+            return 1;
+        }
+    }
+    free(used);
+    return 0;
+}
+
+void emitKeywords(struct language *l, struct keywordTable *t) {
+    int n = 0;
+    t->min = t->max = 0;
+    for (; l->keywords[n]; n++) {
+        int len = keywordLen(l->keywords[n]);
+        if (n == 0 || len < t->min) t->min = len;
+        if (len > t->max) t->max = len;
+    }
+
+    //a table twice the size of the keyword set makes a seed easy to find
+    unsigned mask = 1, seed = 0;
+    while (mask + 1 < 2u * n) mask = mask * 2 + 1;
+    while (!findSeed(l, mask, &seed)) mask = mask * 2 + 1;
+
+    char **slot = calloc(mask + 1, sizeof(char *));
+    for (int j = 0; j < n; j++)
+        slot[keywordHash(l->keywords[j], keywordLen(l->keywords[j]), seed) & mask] =
+            l->keywords[j];
+
+    printf("struct hlKeyword HL_%s_keywords[%u] = {\n", l->filetype, mask + 1);
+    for (unsigned j = 0; j <= mask; j++) {
+        if (!slot[j]) {
+            printf("    {NULL, 0, 0},\n");
+            continue;
+        }
+        int len = keywordLen(slot[j]);
+        printf("    {\"%.*s\", %d, %s},\n", len, slot[j], len,
+                slot[j][len] == '|' ? "HL_KEYWORD2" : "HL_KEYWORD1");
+    }
+    printf("};\n\n");
+    free(slot);
+    t->mask = mask;
+    t->seed = seed;
+}
+
+/*** output ***/
+
+void emitString(const char *s) {
+    if (s) printf("\"%s\"", s);
+    else printf("NULL");
+}
+
+int main(void) {
+    struct keywordTable tables[LANGUAGES];
+
+    printf("/* Generated by hlgen from the language definitions in hlgen.c.\n"
+           " * Edit those and run make rather than editing this file.\n"
+           " */\n\n");
+
+    printf("//bits of the character class tables, see hlgen.c\n"
+           "enum hlClass {\n"
+           "    HLC_SEPARATOR = %d,\n"
+           "    HLC_DIGIT = %d,\n"
+           "    HLC_QUOTE = %d,\n"
+           "    HLC_COMMENT = %d,\n"
+           "    HLC_KEYWORD = %d\n"
+           "};\n\n",
+           HLC_SEPARATOR, HLC_DIGIT, HLC_QUOTE, HLC_COMMENT, HLC_KEYWORD);
+    printf("%s\n", KEYWORD_HASH);
+
+    for (unsigned j = 0; j < LANGUAGES; j++) {
+        struct language *l = &languages[j];
+        printf("char *HL_%s_filematch[] = {", l->filetype);
+        for (int i = 0; l->filematch[i]; i++) printf(" \"%s\",", l->filematch[i]);
+        printf(" NULL };\n\n");
+        emitClasses(l);
+        emitKeywords(l, &tables[j]);
+    }
+
+    printf("struct editorSyntax HLDB[] = {\n");
+    for (unsigned j = 0; j < LANGUAGES; j++) {
+        struct language *l = &languages[j];
+        printf("    {\n");
+        printf("        \"%s\",\n", l->filetype);
+        printf("        HL_%s_filematch,\n", l->filetype);
+        printf("        HL_%s_classes,\n", l->filetype);
+        printf("        HL_%s_keywords, %uu, %uu, %d, %d,\n", l->filetype,
+                tables[j].mask, tables[j].seed, tables[j].min, tables[j].max);
+        printf("        ");
+        emitString(l->singleline_comment_start);
+        printf(", ");
+        emitString(l->multiline_comment_start);
+        printf(", ");
+        emitString(l->multiline_comment_end);
+        int multiline = l->multiline_comment_start && l->multiline_comment_end;
+        printf(",\n        %d, %d, %d,\n",
+                l->singleline_comment_start ? (int)strlen(l->singleline_comment_start) : 0,
+                multiline ? (int)strlen(l->multiline_comment_start) : 0,
+                multiline ? (int)strlen(l->multiline_comment_end) : 0);
+        printf("        %s\n", l->flags);
+        printf("    },\n");
+    }
+    printf("};\n\n");
+    printf("#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))\n");
+    return ferror(stdout) ? 1 : 0;
+}
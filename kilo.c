@@ -14,20 +14,54 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
+#define KILO_SAVE_IOV 1024 //iovecs per writev() when saving, two per row
+#define KILO_INPLACE_MAX_TAIL (16 << 20) //bytes an in-place save may shift
+#define KILO_JOURNAL_SYNC_MS 200 //swap file group commit interval
+#define KILO_UNDO_BUDGET (32 << 20) //default bytes of undo history
+#define KILO_SEARCH_PAR_ROWS (1 << 17) //search in parallel from this many rows
+#define KILO_SEARCH_CHUNK 16384        //rows per parallel search task
+#define KILO_SEARCH_MAX_THREADS 64
+#define KILO_DFA_MAX_STATES 2048 //regex DFA cache size, a power of two
+#define KILO_INDEX_BITS 20 //log2 of the trigram index buckets
+#define KILO_HL_ASYNC_ROWS (1 << 14) //highlight in the background from this many rows
+#define KILO_HL_RING (1 << 14)       //highlighted rows in flight to the main thread
+#define KILO_LAT_SUB_BITS 5 //latency histogram buckets per power of two, log2
+#define KILO_LAT_KEYS 64    //keys a frame reports latency for
+#define KILO_TRACE_EVENTS (1 << 16) //spans KILO_TRACE keeps, the newest
+#define KILO_COLD_DISTANCE (1 << 12) //KILO_COLD: rows from the screen to freeze at
+#define KILO_COLD_BLOCK (64 << 10)   //bytes of text packed per block
+#define KILO_COLD_ROWS 4096          //rows packed per block
+#define KILO_COLD_IDLE (4 << 20)     //bytes packed per idle tick
+#define KILO_COLD_SCAN (1 << 14)     //rows looked at per idle tick
+#define KILO_LZ_HASH_BITS 12
+#define KILO_ROW_INLINE 24 //bytes of text, nul included, an erow holds itself
+#define KILO_ROW_HIST 128  //row length histogram buckets, 8 bytes wide
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -44,17 +78,258 @@ enum editorKey {
     PAGE_DOWN
 };
 
+//swap file record types, see the journal section
+enum journalOp {
+    JRN_INSERT = 1, //insert len bytes into row at col
+    JRN_INSERT_ROW, //insert a row of len bytes before row
+    JRN_DELETE,     //delete the len bytes given from row at col
+    JRN_DELETE_ROW, //delete row
+    JRN_REPLACE     //replace-all given as in editorReplaceApply(), undone if col is 1
+};
+
+//undo entry types; each op's inverse is op ^ 1
+enum undoOp {
+    UNDO_INSERT = 0,
+    UNDO_DELETE,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW,
+    UNDO_REPLACE,   //a whole replace-all, see editorReplaceApply()
+    UNDO_UNREPLACE
+};
+
+enum undoFlags {
+    UNDO_TYPED = 1, //typed text, later keystrokes may extend it
+    UNDO_CHAIN = 2  //undone and redone together with the entry before it
+};
+
 /*** data ***/
 
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
+//Lexer state at the end of a row, carried into the next one: one of these,
+//or the quote character of a string continued with a trailing backslash.
+enum hlState {
+    HL_STATE_UNKNOWN = -1, //not lexed yet
+    HL_STATE_NORMAL = 0,
+    HL_STATE_COMMENT = 1   //inside a multi-line comment
+};
+
+//A slot of a perfect hash table of keywords, empty if name is NULL.
+struct hlKeyword {
+    const char *name;
+    int len;
+    int type; //HL_KEYWORD1 or HL_KEYWORD2
+};
+
+struct editorSyntax {
+    char *filetype;
+    char **filematch;
+    const unsigned char *classes;      //hlClass bits of every byte
+    const struct hlKeyword *keywords;  //kwmask + 1 slots
+    unsigned kwmask, kwseed;           //slot of a word, see editorKeywordHash()
+    int kwmin, kwmax;                  //length of the shortest and longest keyword
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    int scs_len, mcs_len, mce_len; //0 if the language has no such comments
+    int flags;
+};
+
+enum rowFlags {
+    ROW_DIRTY = 1,    //row differs from what is on disk at row->off
+    ROW_INTERNED = 2, //chars is shared through E.intern, see editorInternGet()
+    ROW_INLINE = 4,   //chars is NULL, the text is in row->inl
+    ROW_ALIASED = 8   //render is chars, see editorRowRender()
+};
+
 //struct to hold a row of text
 //rsize and render hold the rendered text, i.e. ti display tabs correctly (using spaces)
+//off and osize locate the row in the file on disk so saves can patch it in place
 typedef struct erow {
     int size;
     int rsize;
     char *chars;
     char *render;
+    unsigned char *hl; //highlight of each byte of render
+    int hlstate;       //hlState at the end of the row
+    int hlstart;       //hlState hl was lexed from, see editorUpdateSyntax()
+    long long off; //byte offset of the row in the file, -1 if not on disk yet
+    int osize;     //size of the row on disk, excluding the line terminator
+    int flags;
+    unsigned stamp; //E.clock when chars was allocated, see editorRowShared()
+    unsigned id;    //stable while the row moves, see editorIndexRow()
+    struct coldBlock *cold; //KILO_COLD: block holding the row, chars is NULL
+    char inl[KILO_ROW_INLINE]; //ROW_INLINE: the text, nul-terminated
 } erow;
 
+//A snapshot is a read-only view of the buffer for background threads.
+//Taking one copies only the row table, payloads stay shared with E.row.
+//A row whose chars predate a live snapshot is copied before it is changed
+//(editorRowUnshare) and the old payload is retired rather than freed until
+//every snapshot that might still see it has been released.
+typedef struct snaprow {
+    char *chars;
+    int size;
+    unsigned id;
+    struct coldBlock *cold; //the row was frozen, see editorSnapChars()
+} snaprow;
+
+typedef struct snapshot {
+    unsigned stamp; //E.clock when taken
+    int numrows;
+    snaprow *row;
+    char *inl;      //copies of the text of rows held inline, see editorSnapshotTake()
+    struct snapshot *next;
+} snapshot;
+
+typedef struct retired {
+    char *chars;
+    int size;
+    struct coldBlock *cold; //a block of frozen rows instead of chars
+    unsigned stamp; //E.clock when retired
+} retired;
+
+//The undo log is one arena of entries stored back to back, each an undoHdr
+//followed by the text it inserted or deleted, so recording an edit is a
+//memcpy and undoing one is a single buffer operation whatever its size.
+//Entries before cur have been applied, the ones after it can be redone.
+typedef struct undoHdr {
+    int op;
+    int flags;
+    int row, col;
+    int len;      //bytes of text after the header
+    int prevsize; //size of the entry before this one, 0 if there is none
+} undoHdr;
+
+typedef struct undoLog {
+    char *buf;
+    long long len;    //bytes in use
+    long long cap;
+    long long cur;    //end of the last applied entry
+    long long last;   //start of the last applied entry, -1 if none
+    long long budget; //bytes of history to keep, KILO_UNDO_BUDGET
+    int next;         //undoFlags for the next entry recorded
+    int suspended;    //don't record, e.g. while loading or undoing
+} undoLog;
+
+//Keys are told apart by what they do for their latency histograms.
+enum latClass {
+    LAT_INSERT = 0,
+    LAT_MOVE,
+    LAT_PAGE,
+    LAT_SEARCH,
+    LAT_OTHER,
+    LAT_CLASSES
+};
+
+//What the bytes the editor holds are for, see editorMemUsage(). Rendered
+//rows are a cache: over KILO_MEM_BUDGET they are dropped away from the
+//screen and rebuilt when drawn.
+enum memKind {
+    MEM_CHARS = 0, //row contents, including payloads retired for snapshots
+    MEM_RENDER,
+    MEM_HL,
+    MEM_ROWS,      //the row table
+    MEM_OUTPUT,    //frames and the buffers they are drawn into
+    MEM_UNDO,
+    MEM_INDEX,     //KILO_INDEX trigram index
+    MEM_COLD,      //KILO_COLD compressed rows
+    MEM_KINDS
+};
+
+//A block of frozen rows unpacked for reading, see editorColdChars().
+typedef struct coldCache {
+    struct coldBlock *block;
+    unsigned serial;
+    char *raw;
+    int cap;
+    int *start;   //where each row starts in raw
+    int nstart;
+    int pagein;   //E.coldcache only: page blocks in and keep them in the LRU
+    unsigned char *packed; //a paged out block read for unpacking
+    int packedcap;
+    int err;      //errno of the last paged out block that couldn't be read
+} coldCache;
+
+//The private file KILO_COLD pages blocks out to when over KILO_MEM_BUDGET,
+//see editorSpillOut().
+typedef struct spillExtent {
+    long long off;
+    long long len;
+} spillExtent;
+
+typedef struct spillFile {
+    int fd;                  //-1 until a block is first paged out
+    long long size;
+    spillExtent *free;       //room left by blocks since freed, none adjacent
+    int nfree;
+    struct coldBlock *lru, *mru; //blocks in memory, least recently used first
+    long long pageins, pageouts;
+    long long out;           //bytes of blocks paged out now
+} spillFile;
+
+//What the rows overlay shows, see editorRowStats().
+typedef struct rowStats {
+    long long at;      //when the stats below were worked out
+    long long ns;      //how long that scan took
+    long long bytes;   //text, newlines included
+    int longest;       //widest rendered row
+    int dirty, inl;    //rows with ROW_DIRTY, ROW_INLINE set
+    int pct[3];        //rows up to p50, p90 and p99 are shorter than these
+} rowStats;
+
+//Counters behind the performance overlay, cheap enough for the hot paths.
+typedef struct perfStats {
+    long long framens;    //time the last frame took to build and write
+    long long framebytes; //size of the last frame
+    unsigned long long allocs; //row, highlight and output buffer allocations
+    int overlay;          //a perfOverlay, cycled with Ctrl-G
+    long long sampled;    //when allocrate was last worked out
+    unsigned long long sampledallocs;
+    unsigned allocrate;   //allocations per second
+} perfStats;
+
+enum perfOverlay {
+    PERF_OVERLAY = 1,
+    MEM_OVERLAY,
+    ROWS_OVERLAY
+};
+
+typedef struct latKey {
+    long long ns; //when editorReadKey() read it
+    int cls;
+} latKey;
+
+//A frame is what the screen should show, captured from the buffer by the
+//main thread (editorCapture) and turned into terminal output by the render
+//thread, so drawing never reads rows that key handling is changing.
+typedef struct frame {
+    unsigned version;  //frames are numbered as they are captured
+    int screenrows, screencols;
+    int numrows;       //rows in the file, 0 draws the welcome message
+    int *len;          //bytes of each screen row, -1 past the end of the file
+    int *ms, *me;      //search match overlaid on each screen row
+    char *text;        //screenrows rows of screencols bytes
+    unsigned char *hl; //highlight of text
+    char *status;      //status bar, screencols bytes
+    char msg[80];
+    int msglen;
+    int cy, cx;        //cursor, 1-based screen position
+    latKey keys[KILO_LAT_KEYS]; //keys whose effect this frame first shows
+    int nkeys;
+} frame;
+
 //struct to hold global state of editor
 struct editorConfig {
     int cx, cy; //cursor positions
@@ -65,23 +340,142 @@ struct editorConfig {
     int screencols;
     int numrows;
     erow *row;
+    rowStats rowstats;
+    int dirty;  //number of edits since last open/save
+    int *dirtyrows; //indices of rows with ROW_DIRTY set, unsorted
+    int ndirtyrows;
+    int diskrows;   //number of rows in the file on disk
+    long long disksize;
+    struct timespec diskmtime;
+    int disknl;     //file on disk ends with a newline
+    int diskcrlf;   //file on disk has lines ending in \r\n
+    int inplace;    //KILO_INPLACE_SAVE: allow patching the file in place
+    struct saveJob *save; //save running in the background, if any
+    struct journal *journal; //swap file of unsaved edits, if any
+    unsigned clock;    //bumped for every snapshot taken
+    snapshot *snaps;   //live snapshots, newest first
+    retired *retired;  //payloads replaced while a snapshot may see them
+    int nretired;
+    int reshaped;      //bumped when rows move to a different index
+    unsigned nextrowid;
+    struct trigramIndex *index; //KILO_INDEX: trigram index for search, if any
+    undoLog undo;
+    struct {
+        int row, col;       //current match, or where the last scan ended
+        int len;            //length of the current match
+        int found;          //there is a current match
+        int regex;          //the query is a regex, toggled with Ctrl-T
+        int origrow, origcol; //cursor when the search started
+        struct searchQuery *query;
+        struct matcher *match; //the main thread's state for query
+        char prompt[80];
+    } find;
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
+    struct editorSyntax *syntax;
+    struct hlJob *hljob;  //background highlighting pass, if any
+    struct hlJob *hldead; //abandoned passes whose thread hasn't exited yet
+    int hlrestart;        //start a new pass when idle
+    int hldefer;          //leave rows unhighlighted, e.g. while loading
+    struct renderer *render; //thread writing frames to the terminal, if any
+    frame frame;          //frame written directly when there is no render thread
+    long long keyns;      //when the last key was read
+    latKey latkeys[KILO_LAT_KEYS]; //keys handled since the last frame
+    int nlatkeys;
+    struct latHist *lathist; //key to frame latency, one histogram per latClass
+    unsigned long long latdropped; //keys that didn't fit in a frame
+    struct trace *trace;  //KILO_TRACE: spans recorded for a trace file, if any
+    perfStats perf;
+    long long mem[MEM_KINDS]; //counted bytes, read them with editorMemUsage()
+    long long membudget;  //KILO_MEM_BUDGET, 0 for none
+    int memhand;          //next row editorMemEnforce() looks at
+    int memidle;          //rows it looked at since it last freed any
+    long long memstuck;   //usage when a whole round freed nothing, or -1
+    int coldon;           //KILO_COLD: freeze rows far from the screen
+    int coldhand;         //next row editorColdFreeze() looks at
+    int coldidle;         //nothing to freeze until the screen moves
+    int coldrowoff;
+    int coldclean;        //rows looked at since one was frozen
+    unsigned coldserial;
+    coldCache coldcache;  //the main thread's unpacked block
+    spillFile spill;
+    struct internTable *intern; //KILO_INTERN: text shared by identical rows, if on
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+/*** filetypes ***/
+
+//HLDB and the tables it points to are generated by hlgen from the language
+//definitions in hlgen.c, see the Makefile.
+#include "hltables.h"
+
+/*** prototypes ***/
+
+void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen();
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorIdle(void);
+void editorRowUnshare(erow *row);
+char *editorInternGet(const char *s, int len);
+void editorInternRelease(erow *row);
+void editorInternRender(erow *row);
+void editorInternFreeRender(erow *row);
+void editorRowUnintern(erow *row);
+int editorRowCharsBytes(erow *row);
+int editorInternStatus(char *buf, int size);
+void editorPerfBytes(char *buf, int size, long long n);
+void editorRowFreeChars(erow *row);
+void editorUndoRecord(int op, int row, int col, const char *s, int len);
+void editorJournalAppend(int op, int row, int col, const char *s, int len);
+void editorJournalClose(int keep);
+void editorJournalOpen(void);
+long long editorJournalMark(void);
+void editorJournalRebase(long long mark, long long size, struct timespec mtime);
+void editorIndexOpen(void);
+void editorReplaceApply(const char *p, int len, int inverse);
+int editorReplaceCheck(const char *p, int len, int inverse);
+void editorIndexRow(erow *row);
+void editorIndexRowsMoved(int from, int to);
+void editorIndexForget(erow *row);
+void editorHighlightRestart(void);
+void editorRenderStop(void);
+long long editorNowNs(void);
+void editorLatencyFrame(frame *f);
+void editorLatencyKey(int cls);
+long long editorTraceBegin(void);
+void editorTraceEnd(const char *name, long long t0, long long n);
+void editorTraceFlush(void);
+void editorTraceThread(const char *name);
+void editorPerfAlloc(void);
+int editorPerfSample(void);
+int editorPerfStatus(char *buf, int size);
+long long editorMemUsage(int kind);
+int editorMemOver(void);
+int editorMemStatus(char *buf, int size);
+const char *editorRowChars(erow *row, coldCache *cc);
+const char *editorSnapChars(snaprow *row, coldCache *cc);
+void editorRowThaw(erow *row);
+void editorColdDestroy(struct coldBlock *b);
+void editorColdCacheFree(coldCache *cc);
+int editorSearchRunning(void);
+int editorPwriteAll(int fd, const char *s, size_t len, long long off);
+
 /*** terminal ***/
 
 /* die() - Prints error message and exit
  */
 void die(const char *s) {
+    editorRenderStop();
+    editorTraceFlush();
     //Clear screen and write error message to screen before exit
     write(STDOUT_FILENO, "\x1b[2J",4);
     write(STDOUT_FILENO, "\x1b[H",3);
     perror(s);
+    //leave the swap file behind so the edits can be recovered
+    editorJournalClose(1);
     exit(1);
 }
 
@@ -131,10 +525,15 @@ void enableRawMode() {
 int editorReadKey() {
     int nread;
     char c;
+    long long t0 = editorTraceBegin();
     while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) 
             die("read");
+        //no key within the read timeout, let background work report in
+        if (editorIdle()) editorRefreshScreen();
     }
+    E.keyns = editorNowNs();
+    editorTraceEnd("editorReadKey", t0, -1);
 
     //Enable moving cursor with arrow keys. Arrow keys return <ESC>[+A-D
     if (c == '\x1b') {
@@ -223,105 +622,4397 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/*** syntax highlighting ***/
+
+/* editorLex() highlights the len bytes at s, starting in lexer state
+ * `state`, into hl and returns the state they end in. With hl NULL only
+ * the state is tracked, which skips keywords and numbers. It reads nothing
+ * but its arguments and E.syntax, so the background highlighter runs it
+ * too. Bytes are classified by the language's hlClass table and words are
+ * looked up in its perfect hash of keywords, both generated by hlgen.
+ */
+int editorLex(const char *s, int len, int state, unsigned char *hl) {
+    if (hl) memset(hl, HL_NORMAL, len);
+    struct editorSyntax *syn = E.syntax;
+    if (syn == NULL) return HL_STATE_NORMAL;
+
+    const unsigned char *cls = syn->classes;
+    const char *scs = syn->singleline_comment_start;
+    const char *mcs = syn->multiline_comment_start;
+    const char *mce = syn->multiline_comment_end;
+    int scs_len = syn->scs_len, mcs_len = syn->mcs_len, mce_len = syn->mce_len;
+    int strings = syn->flags & HL_HIGHLIGHT_STRINGS;
+    int numbers = syn->flags & HL_HIGHLIGHT_NUMBERS;
+
+    if (state == HL_STATE_UNKNOWN) state = HL_STATE_NORMAL;
+    int in_comment = state == HL_STATE_COMMENT && mce_len;
+    int in_string = state > HL_STATE_COMMENT ? state : 0;
+    int prev_sep = 1;
+
+    int i = 0;
+    while (i < len) {
+        if (in_comment) {
+            //jump from one candidate end of the comment to the next
+            int from = i;
+            const char *e = s + i;
+            while ((e = memchr(e, mce[0], len - (e - s))) != NULL &&
+                    (len - (e - s) < mce_len || memcmp(e, mce, mce_len)))
+                e++;
+            i = e ? e - s + mce_len : len;
+            if (hl) memset(&hl[from], HL_MLCOMMENT, i - from);
+            if (!e) break;
+            in_comment = 0;
+            prev_sep = 1;
+            continue;
+        }
+
+        if (in_string) {
+            int from = i;
+            while (i < len) {
+                char c = s[i++];
+                if (c == '\\' && i < len) i++;
+                else if (c == in_string) {
+                    in_string = 0;
+                    break;
+                }
+            }
+            if (hl) memset(&hl[from], HL_STRING, i - from);
+            prev_sep = 1;
+            continue;
+        }
+
+        unsigned char c = s[i];
+        int cl = cls[c];
+
+        if (cl & HLC_COMMENT) {
+            if (scs_len && len - i >= scs_len && !memcmp(&s[i], scs, scs_len)) {
+                if (hl) memset(&hl[i], HL_COMMENT, len - i);
+                break;
+            }
+            if (mcs_len && len - i >= mcs_len && !memcmp(&s[i], mcs, mcs_len)) {
+                if (hl) memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        if ((cl & HLC_QUOTE) && strings) {
+            in_string = c;
+            if (hl) hl[i] = HL_STRING;
+            i++;
+            continue;
+        }
+
+        //keywords and numbers never change the state, skip to what might
+        if (!hl) {
+            i++;
+            while (i < len && !(cls[(unsigned char)s[i]] & (HLC_QUOTE | HLC_COMMENT))) i++;
+            continue;
+        }
+
+        if (numbers) {
+            int prev_number = i > 0 && hl[i - 1] == HL_NUMBER;
+            if (((cl & HLC_DIGIT) && (prev_sep || prev_number)) ||
+                    (c == '.' && prev_number)) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        //a keyword is a whole word, up to the next separator
+        if (prev_sep && (cl & HLC_KEYWORD)) {
+            int end = i + 1;
+            while (end < len && !(cls[(unsigned char)s[end]] & HLC_SEPARATOR)) end++;
+            int wlen = end - i;
+            if (wlen >= syn->kwmin && wlen <= syn->kwmax) {
+                const struct hlKeyword *kw = &syn->keywords[
+                    editorKeywordHash(&s[i], wlen, syn->kwseed) & syn->kwmask];
+                if (kw->len == wlen && !memcmp(kw->name, &s[i], wlen)) {
+                    memset(&hl[i], kw->type, wlen);
+                    i = end;
+                    prev_sep = 0;
+                    continue;
+                }
+            }
+        }
+
+        //the rest of a run of plain separators, or of a word, lexes the same
+        prev_sep = cl & HLC_SEPARATOR;
+        i++;
+        if (prev_sep) {
+            while (i < len && cls[(unsigned char)s[i]] == HLC_SEPARATOR) i++;
+        } else {
+            while (i < len && !(cls[(unsigned char)s[i]] &
+                        (HLC_SEPARATOR | HLC_QUOTE | HLC_COMMENT)))
+                i++;
+        }
+    }
+
+    if (in_comment) return HL_STATE_COMMENT;
+    //only a string whose line ends in a backslash carries on
+    if (in_string && len > 0 && s[len - 1] == '\\') return in_string;
+    return HL_STATE_NORMAL;
+}
+
+/* editorHighlightAlloc() sizes row->hl for the rendered row.
+ */
+void editorHighlightAlloc(erow *row) {
+    //a resized hl is accounted for by editorUpdateRow()
+    if (!row->hl) {
+        E.mem[MEM_HL] += row->rsize + 1;
+        editorPerfAlloc();
+    }
+    row->hl = realloc(row->hl, row->rsize + 1);
+}
+
+/* editorHighlightSet() expands hl, given per byte of row->chars, to the
+ * rendered row, the way editorUpdateRow() expands tabs.
+ */
+void editorHighlightSet(erow *row, const unsigned char *hl) {
+    editorHighlightAlloc(row);
+    if (row->size == row->rsize) {
+        memcpy(row->hl, hl, row->size);
+        return;
+    }
+    const char *chars = editorRowChars(row, &E.coldcache);
+    int idx = 0;
+    for (int j = 0; j < row->size; j++) {
+        if (chars[j] == '\t') {
+            row->hl[idx++] = hl[j];
+            while (idx % KILO_TAB_STOP != 0) row->hl[idx++] = hl[j];
+        } else {
+            row->hl[idx++] = hl[j];
+        }
+    }
+}
+
+/* editorHighlightRow() lexes row starting in lexer state `state`, fills
+ * row->hl and returns the state row ends in.
+ */
+int editorHighlightRow(erow *row, int state) {
+    row->hlstart = state;
+
+    const char *chars = editorRowChars(row, &E.coldcache);
+    //without tabs chars and render line up, so lex straight into row->hl
+    if (row->size == row->rsize) {
+        editorHighlightAlloc(row);
+        return editorLex(chars, row->size, state, row->hl);
+    }
+    unsigned char *hl = malloc(row->size + 1);
+    editorPerfAlloc();
+    state = editorLex(chars, row->size, state, hl);
+    editorHighlightSet(row, hl);
+    free(hl);
+    return state;
+}
+
+/* editorHighlightState() highlights row as editorHighlightRow() does, but
+ * for a frozen row without hl only works out its states.
+ */
+int editorHighlightState(erow *row, int state) {
+    if (row->hl || !row->cold) return editorHighlightRow(row, state);
+    row->hlstart = state;
+    return editorLex(editorRowChars(row, &E.coldcache), row->size, state, NULL);
+}
+
+//Whether row has been lexed, see editorHighlightState().
+int editorRowLexed(erow *row) {
+    return row->hl || (row->cold && row->hlstart != HL_STATE_UNKNOWN);
+}
+
+/* editorUpdateSyntax() re-highlights row, then the rows after it for as long
+ * as one was lexed from a state other than the one the row before now ends
+ * in; past that point every row would lex exactly as before. Rows not lexed
+ * yet are left to the background highlighter, which checks the state it
+ * assumed for each row once it gets there.
+ */
+void editorUpdateSyntax(erow *row) {
+    if (E.hldefer) return;
+
+    while (1) {
+        int state = row > E.row ? row[-1].hlstate : HL_STATE_NORMAL;
+        if (state == HL_STATE_UNKNOWN) state = HL_STATE_NORMAL;
+        row->hlstate = editorHighlightState(row, state);
+
+        int next = row - E.row + 1;
+        if (next >= E.numrows) break;
+        row = &E.row[next];
+        if (!editorRowLexed(row) || row->hlstart == row[-1].hlstate) break;
+    }
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        default: return 37;
+    }
+}
+
+void editorSelectSyntaxHighlight(void) {
+    E.syntax = NULL;
+    if (E.filename == NULL) return;
+
+    char *ext = strrchr(E.filename, '.');
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        for (unsigned int i = 0; s->filematch[i]; i++) {
+            int is_ext = s->filematch[i][0] == '.';
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                    (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                for (int filerow = 0; filerow < E.numrows; filerow++)
+                    editorUpdateSyntax(&E.row[filerow]);
+                return;
+            }
+        }
+    }
+}
+
+/*** row stats ***/
+
+//The bytes the rows would take in a file, newlines included.
+long long editorRowBytes(void) {
+    long long bytes = E.numrows;
+    for (int j = 0; j < E.numrows; j++) bytes += E.row[j].size;
+    return bytes;
+}
+
+/* editorRowStats() works out the stats the rows overlay shows, at most
+ * once a second since on a large buffer the scan takes a while.
+ */
+void editorRowStats(void) {
+    rowStats *st = &E.rowstats;
+    long long now = editorNowNs();
+    if (st->at && now - st->at < 1000000000LL) return;
+
+    unsigned hist[KILO_ROW_HIST] = {0};
+    long long bytes = E.numrows;
+    int longest = 0, dirty = 0, inl = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        erow *row = &E.row[j];
+        int b = row->size >> 3;
+        hist[b < KILO_ROW_HIST ? b : KILO_ROW_HIST - 1]++;
+        bytes += row->size;
+        if (row->rsize > longest) longest = row->rsize;
+        dirty += (row->flags & ROW_DIRTY) != 0;
+        inl += (row->flags & ROW_INLINE) != 0;
+    }
+    st->bytes = bytes;
+    st->longest = longest;
+    st->dirty = dirty;
+    st->inl = inl;
+
+    int pct[3] = {50, 90, 99};
+    long long seen = 0;
+    int b = 0;
+    for (int p = 0; p < 3; p++) {
+        long long want = (long long)E.numrows * pct[p] / 100;
+        while (b < KILO_ROW_HIST - 1 && seen + hist[b] <= want) seen += hist[b++];
+        st->pct[p] = b < KILO_ROW_HIST - 1 ? (b + 1) * 8 : -1;
+    }
+    st->at = editorNowNs();
+    st->ns = st->at - now;
+}
+
+/* editorRowStatus() writes the rows overlay to buf: the size of the text,
+ * the widest row, the row lengths most rows stay under, how many rows are
+ * dirty and held inline, and how long scanning the rows for that took.
+ * Returns its length.
+ */
+int editorRowStatus(char *buf, int size) {
+    rowStats *st = &E.rowstats;
+    char bytes[16], pct[3][16];
+    editorRowStats();
+    editorPerfBytes(bytes, sizeof(bytes), st->bytes);
+    for (int p = 0; p < 3; p++) {
+        if (st->pct[p] < 0)
+            snprintf(pct[p], sizeof(pct[p]), ">=%d", (KILO_ROW_HIST - 1) * 8);
+        else
+            snprintf(pct[p], sizeof(pct[p]), "<%d", st->pct[p]);
+    }
+    int len = snprintf(buf, size, "%d rows %s | widest %d | p50 %s p90 %s p99 %s | "
+            "%d dirty %d inline | scan %.2fms", E.numrows, bytes, st->longest,
+            pct[0], pct[1], pct[2], st->dirty, st->inl, st->ns / 1e6);
+    return len < size ? len : size - 1;
+}
+
 /*** row operations ***/
 
 int editorRowCxToRx(erow *row, int cx) {
+    const char *chars = editorRowChars(row, &E.coldcache);
     int rx = 0;
     
     for (int j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
+        if (chars[j] == '\t')
             rx += (KILO_TAB_STOP -1) - (rx % KILO_TAB_STOP);
         rx++;
     }
     return rx;
 }
 
+//Writes the size bytes of chars to render, expanding tabs to spaces.
+void editorRenderText(char *render, const char *chars, int size) {
+    int idx = 0;
+    for (int j = 0; j < size; j++) {
+        if (chars[j] == '\t') {
+            render[idx++] = ' ';
+            while (idx % KILO_TAB_STOP != 0) render[idx++] = ' ';
+        } else {
+            render[idx++] = chars[j];
+        }
+    }
+    render[idx] = '\0';
+}
+
+/* editorRowRender() builds row->render from row->chars, expanding tabs to
+ * spaces. rsize must be up to date. A row without tabs renders as its
+ * chars, so render just points at them and ROW_ALIASED is set; it is
+ * dropped with editorRowUnalias() before chars change.
+ */
+void editorRowRender(erow *row) {
+    //short rows without tabs are drawn from row->inl, see editorRowRendered()
+    if (row->flags & ROW_INLINE && !memchr(row->inl, '\t', row->size)) return;
+    //a frozen row's text only lasts until its block is unpacked again
+    if (!row->cold && !(row->flags & ROW_INLINE) && !memchr(row->chars, '\t', row->size)) {
+        row->render = row->chars;
+        row->flags |= ROW_ALIASED;
+        return;
+    }
+    if (row->flags & ROW_INTERNED) {
+        editorInternRender(row);
+        return;
+    }
+    const char *chars = editorRowChars(row, &E.coldcache);
+    row->render = malloc(row->rsize + 1);
+    editorPerfAlloc();
+    E.mem[MEM_RENDER] += row->rsize + 1;
+    editorRenderText(row->render, chars, row->size);
+}
+
+/* editorRowRendered() returns the text row is drawn with, rendering it
+ * again if it was dropped.
+ */
+const char *editorRowRendered(erow *row) {
+    if (!row->render) editorRowRender(row);
+    return row->render ? row->render : row->inl;
+}
+
+void editorRowUnalias(erow *row) {
+    if (!(row->flags & ROW_ALIASED)) return;
+    row->render = NULL;
+    row->flags &= ~ROW_ALIASED;
+}
+
+void editorRowFreeRender(erow *row) {
+    if (!row->render) return;
+    if (row->flags & ROW_ALIASED) {
+        editorRowUnalias(row);
+        return;
+    }
+    if (row->flags & ROW_INTERNED) {
+        editorInternFreeRender(row);
+        return;
+    }
+    free(row->render);
+    row->render = NULL;
+    E.mem[MEM_RENDER] -= row->rsize + 1;
+}
+
 /* editorUpdateRow takes a row and creates the string that will actually be displayed on screen
  * This will be used to correctly display tabs as well as other typically non-visible characters
  */
 void editorUpdateRow(erow *row) {
-    int tabs = 0;
+    //hl is resized along with render, one allocated afresh counts itself
+    int hadhl = row->hl != NULL;
+    if (hadhl) E.mem[MEM_HL] -= row->rsize + 1;
 
-    for (int j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
+    editorRowFreeRender(row);
+    row->rsize = editorRowCxToRx(row, row->size);
+    //over the memory budget rows are only rendered to be drawn
+    if (!editorMemOver()) editorRowRender(row);
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP -1) + 1);
+    editorUpdateSyntax(row);
+    if (hadhl) E.mem[MEM_HL] += row->rsize + 1;
+}
 
-    int idx = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+/* editorRowsMoved() is called after rows from `at` on moved by delta (+1
+ * for a row inserted at `at`, -1 for the row at `at` deleted) to keep the
+ * dirty row list and the mapping of rows to the file on disk valid.
+ */
+void editorRowsMoved(int at, int delta) {
+    int kept = 0;
+    for (int j = 0; j < E.ndirtyrows; j++) {
+        int idx = E.dirtyrows[j];
+        if (delta < 0 && idx == at) continue;
+        E.dirtyrows[kept++] = idx >= at ? idx + delta : idx;
+    }
+    E.ndirtyrows = kept;
+
+    //rows on disk no longer sit at their own index, in-place saves are off
+    if (at < E.diskrows) E.disksize = -1;
+    //the background highlighter's results are by row number
+    if (at < E.numrows) {
+        E.reshaped++;
+        editorHighlightRestart();
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+
+    //on insert the new row isn't in place yet, E.numrows counts it on delete
+    if (delta > 0) editorIndexRowsMoved(at + 1, E.numrows + 1);
+    else editorIndexRowsMoved(at, E.numrows);
 }
 
-void editorAppendRow(char *s, size_t len) {
+/* editorRowStoreChars() gives row a copy of s, its size bytes of text, of
+ * its own: in row->inl if it fits, otherwise on the heap.
+ */
+void editorRowStoreChars(erow *row, const char *s) {
+    if (row->size < KILO_ROW_INLINE) {
+        memcpy(row->inl, s, row->size);
+        row->inl[row->size] = '\0';
+        row->chars = NULL;
+        row->flags |= ROW_INLINE;
+        return;
+    }
+    row->chars = malloc(row->size + 1);
+    editorPerfAlloc();
+    E.mem[MEM_CHARS] += row->size + 1;
+    memcpy(row->chars, s, row->size);
+    row->chars[row->size] = '\0';
+}
+
+/* editorRowInline() moves the text of a row that got short enough into
+ * row->inl.
+ */
+void editorRowInline(erow *row) {
+    if (row->flags & ROW_INLINE || row->cold || row->size >= KILO_ROW_INLINE) return;
+    memcpy(row->inl, row->chars, row->size + 1);
+    E.mem[MEM_CHARS] -= editorRowCharsBytes(row);
+    editorRowFreeChars(row);
+    row->chars = NULL;
+    row->flags |= ROW_INLINE;
+}
+
+/* editorRowOutline() moves the text of an inline row to the heap, before
+ * it grows too long for row->inl.
+ */
+void editorRowOutline(erow *row) {
+    if (!(row->flags & ROW_INLINE)) return;
+    row->chars = malloc(row->size + 1);
+    editorPerfAlloc();
+    memcpy(row->chars, row->inl, row->size + 1);
+    row->flags &= ~ROW_INLINE;
+    row->stamp = E.clock;
+    E.mem[MEM_CHARS] += row->size + 1;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+
     E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    
-    int at = E.numrows;
+    editorPerfAlloc();
+    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    if (at < E.numrows) editorRowsMoved(at, 1);
 
     E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    E.row[at].flags = 0;
+    //rows short enough to be held inline gain nothing from sharing
+    if (E.intern && len >= KILO_ROW_INLINE) {
+        E.row[at].chars = editorInternGet(s, len);
+        E.row[at].flags = ROW_INTERNED;
+    } else {
+        editorRowStoreChars(&E.row[at], s);
+    }
+
+    E.row[at].rsize = 0;
+    E.row[at].render = NULL;
+    E.row[at].hl = NULL;
+    E.row[at].hlstate = HL_STATE_UNKNOWN;
+    E.row[at].hlstart = HL_STATE_UNKNOWN;
+    E.row[at].off = -1;
+    E.row[at].osize = 0;
+    E.row[at].stamp = E.clock;
+    E.row[at].id = E.nextrowid++;
+    E.row[at].cold = NULL;
+    E.numrows++;
+    editorUpdateRow(&E.row[at]);
+    editorIndexRow(&E.row[at]);
+
+    editorUndoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+    editorJournalAppend(JRN_INSERT_ROW, at, 0, s, len);
+    E.dirty++;
+}
+
+void editorAppendRow(char *s, size_t len) {
+    editorInsertRow(E.numrows, s, len);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    erow *row = &E.row[at];
+    editorRowThaw(row);
+
+    const char *chars = editorRowChars(row, &E.coldcache);
+    editorUndoRecord(UNDO_DELETE_ROW, at, 0, chars, row->size);
+    editorJournalAppend(JRN_DELETE_ROW, at, 0, chars, row->size);
+    editorIndexForget(row);
+    E.mem[MEM_CHARS] -= editorRowCharsBytes(row);
+    if (row->hl) E.mem[MEM_HL] -= row->rsize + 1;
+    editorRowFreeChars(row);
+    editorRowFreeRender(row);
+    free(row->hl);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    E.numrows--;
+    editorRowsMoved(at, -1);
+    //the row now at `at` starts in a different state if the deleted one changed it
+    if (at < E.numrows) editorUpdateSyntax(&E.row[at]);
+    E.dirty++;
+}
+
+/* editorRowMarkDirty() records that row no longer matches the file on disk.
+ * The dirty list lets a save find modified rows without scanning E.row.
+ */
+void editorRowMarkDirty(erow *row) {
+    if (row->flags & ROW_DIRTY) return;
+    row->flags |= ROW_DIRTY;
+    E.dirtyrows = realloc(E.dirtyrows, sizeof(int) * (E.ndirtyrows + 1));
+    E.dirtyrows[E.ndirtyrows++] = row - E.row;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowThaw(row);
+
+    editorUndoRecord(UNDO_INSERT, row - E.row, at, s, len);
+    editorJournalAppend(JRN_INSERT, row - E.row, at, s, len);
+    if (row->flags & ROW_INLINE && row->size + len < KILO_ROW_INLINE) {
+        memmove(&row->inl[at + len], &row->inl[at], row->size - at + 1);
+        memcpy(&row->inl[at], s, len);
+        //nothing to unshare, but results from snapshots must see the change
+        row->stamp = E.clock;
+    } else {
+        editorRowUnalias(row);
+        editorRowOutline(row);
+        editorRowUnintern(row);
+        editorRowUnshare(row);
+        row->chars = realloc(row->chars, row->size + len + 1);
+        editorPerfAlloc();
+        E.mem[MEM_CHARS] += len;
+        memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+        memcpy(&row->chars[at], s, len);
+    }
+    row->size += len;
+    editorUpdateRow(row);
+    editorIndexRow(row);
+    editorRowMarkDirty(row);
+    E.dirty++;
+}
+
+void editorRowDeleteRange(erow *row, int at, int len) {
+    if (at < 0 || at >= row->size || len <= 0) return;
+    if (len > row->size - at) len = row->size - at;
+    editorRowThaw(row);
+
+    const char *chars = editorRowChars(row, &E.coldcache);
+    editorUndoRecord(UNDO_DELETE, row - E.row, at, chars + at, len);
+    editorJournalAppend(JRN_DELETE, row - E.row, at, chars + at, len);
+    if (row->flags & ROW_INLINE) {
+        memmove(&row->inl[at], &row->inl[at + len], row->size - at - len + 1);
+        row->size -= len;
+        row->stamp = E.clock;
+    } else {
+        editorRowUnalias(row);
+        editorRowUnintern(row);
+        editorRowUnshare(row);
+        memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+        row->size -= len;
+        E.mem[MEM_CHARS] -= len;
+        editorRowInline(row);
+    }
+    editorUpdateRow(row);
+    editorIndexRow(row);
+    editorRowMarkDirty(row);
+    E.dirty++;
+}
+
+/* editorRowSetChars() gives row the new contents chars, which it takes
+ * ownership of. Undo and the journal are left to the caller, which
+ * batches them.
+ */
+void editorRowSetChars(erow *row, char *chars, int size) {
+    editorRowThaw(row);
+    editorPerfAlloc();
+    E.mem[MEM_CHARS] += size + 1 - editorRowCharsBytes(row);
+    editorRowFreeChars(row);
+    row->chars = chars;
+    row->size = size;
+    row->stamp = E.clock;
+    editorRowInline(row);
+    editorUpdateRow(row);
+    editorIndexRow(row);
+    editorRowMarkDirty(row);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    char ch = c;
+    editorRowInsertString(row, at, &ch, 1);
+}
+
+/*** snapshots ***/
+
+/* editorRowShared() tells whether a live snapshot may be reading row->chars.
+ * Snapshots are pushed at the head of E.snaps, so the head is the newest.
+ */
+int editorRowShared(erow *row) {
+    return E.snaps && E.snaps->stamp > row->stamp;
+}
+
+/* editorRowUnshare() gives row a private copy of its chars before they are
+ * modified, retiring the old payload for the snapshots still using it.
+ */
+void editorRowUnshare(erow *row) {
+    if (!editorRowShared(row)) return;
+
+    char *chars = malloc(row->size + 1);
+    editorPerfAlloc();
+    memcpy(chars, row->chars, row->size + 1);
+    editorRowFreeChars(row);
+    row->chars = chars;
+    row->stamp = E.clock;
+}
+
+/* editorRowFreeChars() frees row->chars, or retires it if it is shared.
+ */
+void editorRowFreeChars(erow *row) {
+    editorRowUnalias(row);
+    if (row->flags & ROW_INLINE) {
+        row->flags &= ~ROW_INLINE;
+        return;
+    }
+    if (row->flags & ROW_INTERNED) {
+        editorInternRelease(row);
+        return;
+    }
+    if (!editorRowShared(row)) {
+        free(row->chars);
+        return;
+    }
+    E.retired = realloc(E.retired, sizeof(retired) * (E.nretired + 1));
+    E.retired[E.nretired].chars = row->chars;
+    E.retired[E.nretired].size = row->size;
+    E.retired[E.nretired].cold = NULL;
+    E.mem[MEM_CHARS] += row->size + 1; //the row no longer counts it
+    E.retired[E.nretired++].stamp = E.clock;
+}
+
+/* editorSnapshotTake() is O(numrows) in pointer copies, not in bytes: only
+ * the text of rows held inline, which moves with the rows, is copied.
+ */
+snapshot *editorSnapshotTake(void) {
+    snapshot *snap = malloc(sizeof(snapshot));
+    snap->stamp = ++E.clock;
+    snap->numrows = E.numrows;
+    snap->row = malloc(sizeof(snaprow) * (E.numrows + 1));
+    long long inl = 0;
+    for (int j = 0; j < E.numrows; j++)
+        if (E.row[j].flags & ROW_INLINE) inl += E.row[j].size + 1;
+    snap->inl = malloc(inl);
+    inl = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        snap->row[j].chars = E.row[j].chars;
+        if (E.row[j].flags & ROW_INLINE) {
+            snap->row[j].chars = memcpy(snap->inl + inl, E.row[j].inl, E.row[j].size + 1);
+            inl += E.row[j].size + 1;
+        }
+        snap->row[j].size = E.row[j].size;
+        snap->row[j].id = E.row[j].id;
+        snap->row[j].cold = E.row[j].cold;
+    }
+    snap->next = E.snaps;
+    E.snaps = snap;
+    return snap;
+}
+
+/* editorSnapshotRelease() drops a snapshot once its reader is done with it
+ * and frees the retired payloads that no live snapshot can see any more.
+ */
+void editorSnapshotRelease(snapshot *snap) {
+    snapshot **pp = &E.snaps;
+    while (*pp != snap) pp = &(*pp)->next;
+    *pp = snap->next;
+    free(snap->row);
+    free(snap->inl);
+    free(snap);
+
+    //a payload retired at time t is visible to live snapshots taken at or before t
+    snapshot *oldest = E.snaps;
+    while (oldest && oldest->next) oldest = oldest->next;
+
+    int kept = 0;
+    for (int j = 0; j < E.nretired; j++) {
+        if (oldest && oldest->stamp <= E.retired[j].stamp)
+            E.retired[kept++] = E.retired[j];
+        else if (E.retired[j].cold) {
+            editorColdDestroy(E.retired[j].cold);
+        } else {
+            free(E.retired[j].chars);
+            E.mem[MEM_CHARS] -= E.retired[j].size + 1;
+        }
+    }
+    E.nretired = kept;
+}
+
+/*** interning ***/
+
+//With KILO_INTERN set, rows inserted with the same text share one copy of
+//it: row->chars points into an entry of E.intern, which counts the rows
+//using it, and ROW_INTERNED is set. Changing such a row first gives it
+//chars of its own, see editorRowUnintern(). Their render is shared too,
+//or is the shared text itself if they have no tabs; their hl isn't. Only
+//text as inserted is shared; rows edited into the same text keep their own.
+typedef struct internEntry {
+    struct internEntry *next; //in its hash chain
+    unsigned hash;
+    unsigned refs;            //rows sharing the text
+    unsigned stamp;           //E.clock when made, see editorInternRelease()
+    int size;
+    char *render;             //shared the same way, or NULL
+    unsigned renders;         //rows using render
+    //the text follows, nul-terminated
+} internEntry;
+
+typedef struct internTable {
+    internEntry **bucket;
+    unsigned mask;
+    unsigned entries;
+    long long rows;           //rows sharing entries
+    long long rowbytes;       //their text, if each had its own
+    long long bytes;          //held by the entries and buckets
+} internTable;
+
+unsigned editorInternHash(const char *s, int len) {
+    unsigned h = 2166136261u;
+    for (int j = 0; j < len; j++) h = (h ^ (unsigned char)s[j]) * 16777619u;
+    return h;
+}
+
+internEntry *editorInternEntry(erow *row) {
+    return (internEntry *)row->chars - 1;
+}
+
+void editorInternGrow(internTable *t) {
+    unsigned mask = t->mask * 2 + 1;
+    internEntry **bucket = calloc(mask + 1, sizeof(internEntry *));
+    for (unsigned j = 0; j <= t->mask; j++) {
+        internEntry *e = t->bucket[j];
+        while (e) {
+            internEntry *next = e->next;
+            e->next = bucket[e->hash & mask];
+            bucket[e->hash & mask] = e;
+            e = next;
+        }
+    }
+    free(t->bucket);
+    t->bucket = bucket;
+    t->bytes += (long long)(mask - t->mask) * sizeof(internEntry *);
+    E.mem[MEM_CHARS] += (long long)(mask - t->mask) * sizeof(internEntry *);
+    t->mask = mask;
+}
+
+/* editorInternGet() returns the shared copy of s for a row about to use it,
+ * making one if there is none.
+ */
+char *editorInternGet(const char *s, int len) {
+    internTable *t = E.intern;
+    unsigned h = editorInternHash(s, len);
+    internEntry *e = t->bucket[h & t->mask];
+    while (e && (e->hash != h || e->size != len || memcmp(e + 1, s, len) != 0))
+        e = e->next;
+
+    if (!e) {
+        if (t->entries > t->mask) editorInternGrow(t);
+        e = malloc(sizeof(internEntry) + len + 1);
+        editorPerfAlloc();
+        e->hash = h;
+        e->refs = 0;
+        e->stamp = E.clock;
+        e->size = len;
+        e->render = NULL;
+        e->renders = 0;
+        memcpy(e + 1, s, len);
+        ((char *)(e + 1))[len] = '\0';
+        e->next = t->bucket[h & t->mask];
+        t->bucket[h & t->mask] = e;
+        t->entries++;
+        t->bytes += sizeof(internEntry) + len + 1;
+        E.mem[MEM_CHARS] += sizeof(internEntry) + len + 1;
+    }
+    e->refs++;
+    t->rows++;
+    t->rowbytes += len + 1;
+    return (char *)(e + 1);
+}
+
+/* editorInternRelease() drops row's share of its text. The last row to go
+ * frees the entry, or retires it if a snapshot may be reading it: any
+ * snapshot taken since the entry was made may.
+ */
+void editorInternRelease(erow *row) {
+    internTable *t = E.intern;
+    internEntry *e = editorInternEntry(row);
+    editorRowFreeRender(row);
+    row->flags &= ~ROW_INTERNED;
+    t->rows--;
+    t->rowbytes -= e->size + 1;
+    if (--e->refs > 0) return;
+
+    internEntry **pp = &t->bucket[e->hash & t->mask];
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    t->entries--;
+    t->bytes -= sizeof(internEntry) + e->size + 1;
+
+    if (E.snaps && E.snaps->stamp > e->stamp) {
+        E.retired = realloc(E.retired, sizeof(retired) * (E.nretired + 1));
+        E.retired[E.nretired].chars = (char *)e;
+        E.retired[E.nretired].size = sizeof(internEntry) + e->size; //as accounted
+        E.retired[E.nretired].cold = NULL;
+        E.retired[E.nretired++].stamp = E.clock;
+    } else {
+        E.mem[MEM_CHARS] -= sizeof(internEntry) + e->size + 1;
+        free(e);
+    }
+}
+
+/* editorInternRender() points row->render at the render of its entry,
+ * building it for the first row drawn. Rows with the same text render the
+ * same; only hl depends on the rows before.
+ */
+void editorInternRender(erow *row) {
+    internEntry *e = editorInternEntry(row);
+    if (!e->render) {
+        e->render = malloc(row->rsize + 1);
+        editorPerfAlloc();
+        E.mem[MEM_RENDER] += row->rsize + 1;
+        editorRenderText(e->render, row->chars, row->size);
+    }
+    e->renders++;
+    row->render = e->render;
+}
+
+void editorInternFreeRender(erow *row) {
+    internEntry *e = editorInternEntry(row);
+    row->render = NULL;
+    if (--e->renders > 0) return;
+    free(e->render);
+    e->render = NULL;
+    E.mem[MEM_RENDER] -= row->rsize + 1;
+}
+
+/* editorRowUnintern() gives row a copy of its text of its own before it
+ * is changed in place.
+ */
+void editorRowUnintern(erow *row) {
+    if (!(row->flags & ROW_INTERNED)) return;
+    char *chars = malloc(row->size + 1);
+    editorPerfAlloc();
+    memcpy(chars, row->chars, row->size + 1);
+    editorInternRelease(row);
+    row->chars = chars;
+    row->stamp = E.clock;
+    E.mem[MEM_CHARS] += row->size + 1;
+}
+
+//Bytes of row->chars counted in E.mem[MEM_CHARS] for the row itself.
+int editorRowCharsBytes(erow *row) {
+    return row->flags & (ROW_INTERNED | ROW_INLINE) ? 0 : row->size + 1;
+}
+
+/* editorInternStatus() writes how well rows are shared to buf, for the
+ * memory overlay. Returns its length.
+ */
+int editorInternStatus(char *buf, int size) {
+    internTable *t = E.intern;
+    char rowbytes[16], bytes[16];
+    editorPerfBytes(rowbytes, sizeof(rowbytes), t->rowbytes);
+    editorPerfBytes(bytes, sizeof(bytes), t->bytes);
+    int len = snprintf(buf, size, " | %lld rows share %u lines, %s in %s (%.1fx)",
+            t->rows, t->entries, rowbytes, bytes,
+            t->bytes ? (double)t->rowbytes / t->bytes : 0);
+    return len < size ? len : size - 1;
+}
+
+/*** cold rows ***/
+
+//With KILO_COLD set, rows more than KILO_COLD_DISTANCE rows away from the
+//screen are frozen: runs of them are packed into blocks of up to
+//KILO_COLD_BLOCK bytes of text, compressed with the LZ77 codec below, and
+//their chars, render and hl are freed. Readers go through editorRowChars(),
+//which unpacks a block into a cache once for all of its rows, so scrolling
+//through frozen rows costs one unpacking per block. Only changing a row
+//thaws it back into chars of its own. A block never changes once packed,
+//so snapshots and search threads read it without locking, and it retires
+//like any other payload when its last row thaws.
+
+//Rows are inserted and deleted but never reordered, so a frozen row keeps
+//its place in its block. Rows loaded together have ids counting up from
+//the block's first, which gives the place; other blocks map ids to places.
+typedef struct coldEntry {
+    unsigned id; //of a row packed in the block
+    int at;      //its place among the rows of the block
+} coldEntry;
+
+typedef struct coldBlock {
+    unsigned stamp;    //E.clock when packed, see editorRowShared()
+    unsigned serial;   //tells apart blocks allocated at the same address
+    int nrows;
+    int live;          //rows still frozen in it
+    int rawlen;        //bytes unpacked: the rows, each followed by a newline
+    int len;           //bytes packed
+    unsigned first;    //id of the first row
+    coldEntry *entry;  //sorted by id, NULL if the ids count up from first
+    unsigned char *data;    //NULL while paged out
+    long long swapoff;      //where data is in the spill file, -1 if never written
+    struct coldBlock *older, *newer; //E.spill's LRU, while data is in memory
+} coldBlock;
+
+/* editorLzCompress() packs src into dst, which must have room for
+ * editorLzBound(len) bytes, and returns the packed length. The format is a
+ * sequence of a token byte with the literal length in the high nibble and
+ * the match length minus 4 in the low one, 15 meaning more length bytes
+ * follow, then the literals, then a 2-byte offset back to the match. The
+ * last sequence has literals only.
+ */
+int editorLzBound(int len) {
+    return len + len / 255 + 16;
+}
+
+unsigned char *editorLzLength(unsigned char *op, int n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+int editorLzCompress(const unsigned char *src, int len, unsigned char *dst) {
+    int table[1 << KILO_LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+    unsigned char *op = dst;
+    int anchor = 0, i = 0, misses = 0;
+
+    //the last bytes are always literals, which keeps the decoder simple
+    while (i + 12 <= len) {
+        uint32_t seq;
+        memcpy(&seq, src + i, 4);
+        unsigned h = (seq * 2654435761u) >> (32 - KILO_LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > 65535 || memcmp(src + ref, src + i, 4) != 0) {
+            //skip faster through data that doesn't compress
+            i += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        int mlen = 4;
+        while (i + mlen < len - 5 && src[ref + mlen] == src[i + mlen]) mlen++;
+        int lit = i - anchor;
+        unsigned char *token = op++;
+        *token = (lit < 15 ? lit : 15) << 4 | (mlen - 4 < 15 ? mlen - 4 : 15);
+        if (lit >= 15) op = editorLzLength(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (i - ref) & 0xff;
+        *op++ = (i - ref) >> 8;
+        if (mlen - 4 >= 15) op = editorLzLength(op, mlen - 4 - 15);
+        i += mlen;
+        anchor = i;
+    }
+
+    int lit = len - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) op = editorLzLength(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/* editorLzDecompress() unpacks what editorLzCompress() packed into dst.
+ * Returns the unpacked length.
+ */
+int editorLzDecompress(const unsigned char *src, int len, char *dst) {
+    const unsigned char *ip = src, *end = src + len;
+    char *op = dst;
+
+    while (ip < end) {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15) {
+            int n;
+            do lit += n = *ip++; while (n == 255);
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip >= end) break;
+
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            int n;
+            do mlen += n = *ip++; while (n == 255);
+        }
+        const char *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            //the match overlaps what it copies, as runs do
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
+
+long long editorColdBytes(coldBlock *b) {
+    return sizeof(coldBlock) + (b->data ? b->len : 0) +
+        (b->entry ? (long long)b->nrows * sizeof(coldEntry) : 0);
+}
+
+/* Blocks are paged out to the spill file, least recently used first, while
+ * the editor is over KILO_MEM_BUDGET; the file is unlinked as soon as it is
+ * made, so nothing is left behind. A block never changes, so once written
+ * paging it out again only frees its data. Only the main thread pages in,
+ * when it draws or changes a frozen row; background readers read paged out
+ * blocks with pread() into their own cache, and don't disturb the LRU as
+ * they sweep the buffer. Paging out waits until no background reader runs.
+ */
+void editorLruUnlink(coldBlock *b) {
+    spillFile *sp = &E.spill;
+    if (b->older) b->older->newer = b->newer;
+    else sp->lru = b->newer;
+    if (b->newer) b->newer->older = b->older;
+    else sp->mru = b->older;
+    b->older = b->newer = NULL;
+}
+
+void editorLruPush(coldBlock *b) {
+    spillFile *sp = &E.spill;
+    b->older = sp->mru;
+    b->newer = NULL;
+    if (sp->mru) sp->mru->newer = b;
+    else sp->lru = b;
+    sp->mru = b;
+}
+
+int editorSpillOpen(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-spill-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+    unlink(path);
+    E.spill.fd = fd;
+    return 0;
+}
+
+/* editorSpillAlloc() finds room for len bytes in the spill file, in a hole
+ * a freed block left if one is big enough.
+ */
+long long editorSpillAlloc(int len) {
+    spillFile *sp = &E.spill;
+    for (int j = 0; j < sp->nfree; j++) {
+        spillExtent *x = &sp->free[j];
+        if (x->len < len) continue;
+        long long off = x->off;
+        x->off += len;
+        x->len -= len;
+        if (x->len == 0) sp->free[j] = sp->free[--sp->nfree];
+        return off;
+    }
+    long long off = sp->size;
+    sp->size += len;
+    return off;
+}
+
+/* editorSpillRelease() gives back the len bytes at off, merged with the
+ * holes next to them. Room that ends up at the end of the file is cut off
+ * it instead of being kept as a hole.
+ */
+void editorSpillRelease(long long off, long long len) {
+    spillFile *sp = &E.spill;
+    for (int j = 0; j < sp->nfree; ) {
+        spillExtent *x = &sp->free[j];
+        if (x->off + x->len != off && off + len != x->off) {
+            j++;
+            continue;
+        }
+        if (x->off < off) off = x->off;
+        len += x->len;
+        sp->free[j] = sp->free[--sp->nfree];
+    }
+    if (off + len == sp->size && ftruncate(sp->fd, off) == 0) {
+        sp->size = off;
+        return;
+    }
+    sp->free = realloc(sp->free, sizeof(spillExtent) * (sp->nfree + 1));
+    sp->free[sp->nfree].off = off;
+    sp->free[sp->nfree++].len = len;
+}
+
+/* editorSpillOut() pages b out. Returns -1 if it can't be written.
+ */
+int editorSpillOut(coldBlock *b) {
+    spillFile *sp = &E.spill;
+    if (b->swapoff == -1) {
+        if (sp->fd == -1 && editorSpillOpen() == -1) return -1;
+        long long off = editorSpillAlloc(b->len);
+        if (editorPwriteAll(sp->fd, (char *)b->data, b->len, off) == -1) {
+            editorSpillRelease(off, b->len);
+            return -1;
+        }
+        b->swapoff = off;
+    }
+    editorLruUnlink(b);
+    E.mem[MEM_COLD] -= b->len;
+    free(b->data);
+    __atomic_store_n(&b->data, NULL, __ATOMIC_RELEASE);
+    sp->pageouts++;
+    sp->out += b->len;
+    return 0;
+}
+
+//Reads paged out b into buf, which has room for b->len bytes. Returns 0,
+//or -1 with errno set.
+int editorSpillRead(coldBlock *b, unsigned char *buf) {
+    for (int done = 0; done < b->len; ) {
+        ssize_t n = pread(E.spill.fd, buf + done, b->len - done, b->swapoff + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == 0) errno = EIO; //the file is shorter than what was written
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+void editorSpillIn(coldBlock *b) {
+    unsigned char *data = malloc(b->len);
+    //the main thread can't go on without the rows; the journal has the edits
+    if (editorSpillRead(b, data) == -1) die("spill read");
+    __atomic_store_n(&b->data, data, __ATOMIC_RELEASE);
+    E.mem[MEM_COLD] += b->len;
+    editorLruPush(b);
+    E.spill.pageins++;
+    E.spill.out -= b->len;
+}
+
+/* editorSpillEnforce() pages out the least recently used blocks while the
+ * editor is over its budget.
+ */
+void editorSpillEnforce(void) {
+    if (!E.membudget || !E.spill.lru) return;
+    //snapshots and search threads may be reading the data
+    if (E.snaps || editorSearchRunning()) return;
+    long long over = editorMemUsage(MEM_KINDS) - E.membudget;
+    while (over > 0 && E.spill.lru) {
+        coldBlock *b = E.spill.lru;
+        if (editorSpillOut(b) == -1) return;
+        over -= b->len;
+    }
+}
+
+int editorColdCached(coldCache *cc, coldBlock *b) {
+    return cc->block == b && cc->serial == b->serial;
+}
+
+/* editorColdChars() returns the text of the row with the given id packed in
+ * b, unpacking b into cc unless it is there already. The text is valid
+ * until cc unpacks another block and isn't nul-terminated. A reader that
+ * doesn't page in gets NULL, with cc->err set, if b is paged out and can't
+ * be read back.
+ */
+const char *editorColdChars(coldBlock *b, unsigned id, coldCache *cc) {
+    if (!editorColdCached(cc, b)) {
+        unsigned char *data = __atomic_load_n(&b->data, __ATOMIC_ACQUIRE);
+        if (cc->pagein) {
+            if (!data) editorSpillIn(b);
+            else if (b != E.spill.mru) {
+                editorLruUnlink(b);
+                editorLruPush(b);
+            }
+            data = b->data;
+        } else if (!data) {
+            if (cc->packedcap < b->len) {
+                cc->packed = realloc(cc->packed, b->len);
+                cc->packedcap = b->len;
+            }
+            if (editorSpillRead(b, cc->packed) == -1) {
+                cc->err = errno;
+                return NULL;
+            }
+            data = cc->packed;
+        }
+        if (cc->cap < b->rawlen) {
+            cc->raw = realloc(cc->raw, b->rawlen);
+            cc->cap = b->rawlen;
+        }
+        editorLzDecompress(data, b->len, cc->raw);
+        if (cc->nstart < b->nrows) {
+            cc->start = realloc(cc->start, sizeof(int) * b->nrows);
+            cc->nstart = b->nrows;
+        }
+        //frozen rows hold no newlines, so they are found again rather than
+        //stored; see editorColdFreeze()
+        char *p = cc->raw;
+        for (int j = 0; j < b->nrows; j++) {
+            cc->start[j] = p - cc->raw;
+            p = memchr(p, '\n', cc->raw + b->rawlen - p);
+            p++;
+        }
+        cc->block = b;
+        cc->serial = b->serial;
+    }
+    if (!b->entry) return cc->raw + cc->start[id - b->first];
+
+    int lo = 0, hi = b->nrows - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (b->entry[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return cc->raw + cc->start[b->entry[lo].at];
+}
+
+/* editorRowChars() is how rows that may be frozen or held inline are
+ * read. Text held inline moves with the row.
+ */
+const char *editorRowChars(erow *row, coldCache *cc) {
+    if (row->cold) return editorColdChars(row->cold, row->id, cc);
+    return row->flags & ROW_INLINE ? row->inl : row->chars;
+}
+
+const char *editorSnapChars(snaprow *row, coldCache *cc) {
+    return row->cold ? editorColdChars(row->cold, row->id, cc) : row->chars;
+}
+
+void editorColdCacheFree(coldCache *cc) {
+    int pagein = cc->pagein;
+    free(cc->raw);
+    free(cc->start);
+    free(cc->packed);
+    memset(cc, 0, sizeof(*cc));
+    cc->pagein = pagein;
+}
+
+void editorColdDestroy(coldBlock *b) {
+    E.mem[MEM_COLD] -= editorColdBytes(b);
+    if (b->data) editorLruUnlink(b);
+    else E.spill.out -= b->len;
+    if (b->swapoff != -1) editorSpillRelease(b->swapoff, b->len);
+    free(b->entry);
+    free(b->data);
+    free(b);
+}
+
+/* editorRowThaw() gives a frozen row chars of its own again, before it is
+ * changed. The block is freed, or retired if a snapshot may see it, once
+ * its last row is thawed.
+ */
+void editorRowThaw(erow *row) {
+    coldBlock *b = row->cold;
+    if (!b) return;
+
+    editorRowStoreChars(row, editorRowChars(row, &E.coldcache));
+    row->cold = NULL;
+    row->stamp = E.clock;
+
+    if (--b->live > 0) return;
+    if (E.snaps && E.snaps->stamp > b->stamp) {
+        E.retired = realloc(E.retired, sizeof(retired) * (E.nretired + 1));
+        E.retired[E.nretired].chars = NULL;
+        E.retired[E.nretired].cold = b;
+        E.retired[E.nretired++].stamp = E.clock;
+    } else {
+        editorColdDestroy(b);
+    }
+}
+
+int editorColdCmpEntry(const void *a, const void *b) {
+    unsigned x = ((const coldEntry *)a)->id, y = ((const coldEntry *)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* editorColdDrop() frees what a frozen row can do without: render and hl
+ * are rebuilt if the row is drawn, the lexer states stay.
+ */
+void editorColdDrop(erow *row) {
+    editorRowFreeRender(row);
+    if (!row->hl) return;
+    E.mem[MEM_HL] -= row->rsize + 1;
+    free(row->hl);
+    row->hl = NULL;
+}
+
+/* editorColdPack() freezes the n rows from at into a new block.
+ */
+void editorColdPack(int at, int n) {
+    coldBlock *b = malloc(sizeof(coldBlock));
+    b->first = E.row[at].id;
+    b->entry = NULL;
+    b->rawlen = 0;
+    for (int j = 0; j < n; j++) {
+        b->rawlen += E.row[at + j].size + 1;
+        if (!b->entry && E.row[at + j].id != b->first + j)
+            b->entry = malloc(sizeof(coldEntry) * n);
+    }
+
+    char *raw = malloc(b->rawlen);
+    int off = 0;
+    for (int j = 0; j < n; j++) {
+        erow *row = &E.row[at + j];
+        if (b->entry) {
+            b->entry[j].id = row->id;
+            b->entry[j].at = j;
+        }
+        memcpy(raw + off, editorRowChars(row, &E.coldcache), row->size);
+        off += row->size;
+        raw[off++] = '\n';
+    }
+    if (b->entry) qsort(b->entry, n, sizeof(coldEntry), editorColdCmpEntry);
+
+    b->data = malloc(editorLzBound(b->rawlen));
+    b->len = editorLzCompress((unsigned char *)raw, b->rawlen, b->data);
+    b->data = realloc(b->data, b->len);
+    free(raw);
+    b->stamp = E.clock;
+    b->serial = ++E.coldserial;
+    b->nrows = b->live = n;
+    b->swapoff = -1;
+    editorLruPush(b);
+    E.mem[MEM_COLD] += editorColdBytes(b);
+
+    for (int j = 0; j < n; j++) {
+        erow *row = &E.row[at + j];
+        E.mem[MEM_CHARS] -= editorRowCharsBytes(row);
+        editorRowFreeChars(row);
+        row->chars = NULL;
+        row->cold = b;
+        editorColdDrop(row);
+    }
+}
+
+/* editorColdFreeze() walks the buffer from E.coldhand packing runs of rows
+ * far from the screen, modified or not, until about budget bytes were
+ * packed. With wrap set it looks at no more than KILO_COLD_SCAN rows and
+ * goes round the buffer; unset it stops at the last row and leaves a run
+ * there unpacked, for rows still being loaded to extend. Frozen rows far
+ * from the screen lose the render and hl drawing them built. A row with a
+ * newline in it, typed with Ctrl-J, is never frozen: blocks find their rows
+ * by the newlines between them.
+ */
+void editorColdFreeze(long long budget, int wrap) {
+    if (!E.coldon || E.numrows == 0) return;
+    if (E.coldidle && E.coldrowoff == E.rowoff) return;
+    //parallel search reads the rows in place
+    if (editorSearchRunning()) return;
+
+    int lo = E.rowoff - KILO_COLD_DISTANCE;
+    int hi = E.rowoff + E.screenrows + KILO_COLD_DISTANCE;
+    int run = -1, runbytes = 0, packed = 0;
+    int j = E.coldhand;
+    if (j >= E.numrows) j = wrap ? 0 : E.numrows;
+
+    int limit = wrap && E.numrows > KILO_COLD_SCAN ? KILO_COLD_SCAN : E.numrows;
+    int scanned = 0;
+    for (; scanned < limit && budget > 0; scanned++, j++) {
+        if (j == E.numrows) {
+            if (!wrap) break;
+            if (run != -1) {
+                editorColdPack(run, j - run);
+                budget -= runbytes;
+                packed = 1;
+                run = -1;
+            }
+            j = 0;
+        }
+        erow *row = &E.row[j];
+        int far = j < lo || j >= hi;
+        if (row->cold && far) editorColdDrop(row);
+
+        int ok = far && !row->cold &&
+            !memchr(editorRowChars(row, &E.coldcache), '\n', row->size);
+        if (ok) {
+            if (run == -1) {
+                run = j;
+                runbytes = 0;
+            }
+            runbytes += row->size + 1;
+        }
+        if (run != -1 && (!ok || runbytes >= KILO_COLD_BLOCK ||
+                    j + 1 - run >= KILO_COLD_ROWS)) {
+            editorColdPack(run, ok ? j + 1 - run : j - run);
+            budget -= runbytes;
+            packed = 1;
+            run = -1;
+        }
+    }
+    if (run != -1) {
+        if (wrap) {
+            editorColdPack(run, j - run);
+            packed = 1;
+        } else {
+            j = run;
+        }
+    }
+    E.coldhand = j;
+    //once a whole round finds nothing to do, wait for the screen to move
+    E.coldclean = packed ? 0 : E.coldclean + scanned;
+    if (wrap && E.coldclean >= E.numrows) {
+        E.coldidle = 1;
+        E.coldrowoff = E.rowoff;
+        E.coldclean = 0;
+    }
+}
+
+/*** background highlighting ***/
+
+//A file of KILO_HL_ASYNC_ROWS rows or more is highlighted by a thread over a
+//snapshot, the rows on screen first and then outwards from them. Results
+//come back through a single-producer single-consumer ring that the main
+//thread drains without ever waiting; until a row's result is installed the
+//row is drawn plain.
+typedef struct hlResult {
+    int row;
+    int start, end;    //lexer state before and after the row
+    unsigned char *hl; //highlight of each byte of chars
+} hlResult;
+
+typedef struct hlJob {
+    snapshot *snap;
+    int screenrows;
+    int viewport;        //E.rowoff, published by the main thread
+    int cancel;
+    int exited;          //the thread pushes nothing more
+    pthread_t thread;
+    unsigned head, tail; //results pushed by the thread, taken by the main thread
+    hlResult ring[KILO_HL_RING];
+    struct hlJob *next;  //on E.hldead
+} hlJob;
+
+/* editorHighlightPush() hands res to the main thread, waiting for room in
+ * the ring. Returns 0 if the job was cancelled meanwhile.
+ */
+int editorHighlightPush(hlJob *job, hlResult *res) {
+    unsigned head = job->head;
+    while (head - __atomic_load_n(&job->tail, __ATOMIC_ACQUIRE) == KILO_HL_RING) {
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) return 0;
+        usleep(1000);
+    }
+    job->ring[head % KILO_HL_RING] = *res;
+    __atomic_store_n(&job->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void *editorHighlightThread(void *arg) {
+    hlJob *job = arg;
+    snaprow *rows = job->snap->row;
+    int n = job->snap->numrows;
+    int *st = malloc(sizeof(int) * (n + 1)); //state at the end of each row
+    char *done = calloc(n + 1, 1);
+    int known = 0; //rows whose state is in st
+    int left = n;
+    int v = -1, below = 0, above = -1, turn = 0;
+    coldCache cc = {0};
+
+    while (left > 0 && !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        int vp = __atomic_load_n(&job->viewport, __ATOMIC_RELAXED);
+        if (vp >= n) vp = n - 1;
+        if (vp < 0) vp = 0;
+        if (vp != v) {
+            v = vp;
+            below = v;
+            above = v - 1;
+        }
+        while (below < n && done[below]) below++;
+        while (above >= 0 && done[above]) above--;
+
+        //the screen first, then alternately a row below it and one above
+        int r;
+        if (above < 0 || (below < n && (below < v + job->screenrows || (turn ^= 1))))
+            r = below;
+        else
+            r = above;
+
+        //only the state is needed up to r, which skips keywords and numbers
+        const char *s;
+        while (known < r && (s = editorSnapChars(&rows[known], &cc))) {
+            st[known] = editorLex(s, rows[known].size,
+                    known ? st[known - 1] : HL_STATE_NORMAL, NULL);
+            known++;
+        }
+        //rows paged out that can't be read end the pass early, as a cancel
+        //does; the rows left are drawn plain until they are edited
+        if (known < r || !(s = editorSnapChars(&rows[r], &cc))) break;
+
+        hlResult res;
+        res.row = r;
+        res.start = r ? st[r - 1] : HL_STATE_NORMAL;
+        //frozen rows only get their states
+        res.hl = rows[r].cold ? NULL : malloc(rows[r].size + 1);
+        res.end = editorLex(s, rows[r].size, res.start, res.hl);
+        if (known == r) st[known++] = res.end;
+        done[r] = 1;
+        left--;
+        if (!editorHighlightPush(job, &res)) {
+            free(res.hl);
+            break;
+        }
+    }
+    free(st);
+    free(done);
+    editorColdCacheFree(&cc);
+    __atomic_store_n(&job->exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* editorHighlightAll() highlights every row here and now.
+ */
+void editorHighlightAll(void) {
+    int state = HL_STATE_NORMAL;
+    for (int j = 0; j < E.numrows; j++) {
+        E.row[j].hlstate = editorHighlightState(&E.row[j], state);
+        state = E.row[j].hlstate;
+    }
+}
+
+/* editorHighlightStart() starts a background pass over all rows. Returns 0
+ * if no thread could be started.
+ */
+int editorHighlightStart(void) {
+    hlJob *job = calloc(1, sizeof(hlJob));
+    job->snap = editorSnapshotTake();
+    job->screenrows = E.screenrows;
+    job->viewport = E.rowoff;
+    if (pthread_create(&job->thread, NULL, editorHighlightThread, job) != 0) {
+        editorSnapshotRelease(job->snap);
+        free(job);
+        return 0;
+    }
+    E.hljob = job;
+    return 1;
+}
+
+/* editorHighlightOpen() highlights the rows just loaded, in the background
+ * if there are many of them.
+ */
+void editorHighlightOpen(void) {
+    E.hldefer = 0;
+    if (!E.syntax) return;
+    if (E.numrows >= KILO_HL_ASYNC_ROWS && editorHighlightStart()) return;
+    editorHighlightAll();
+}
+
+/* editorHighlightFree() disposes of a job whose thread has exited.
+ */
+void editorHighlightFree(hlJob *job) {
+    pthread_join(job->thread, NULL);
+    for (unsigned j = job->tail; j != job->head; j++)
+        free(job->ring[j % KILO_HL_RING].hl);
+    editorSnapshotRelease(job->snap);
+    free(job);
+}
+
+/* editorHighlightRestart() abandons the background pass once rows moved,
+ * since its results are by row number. A pass over a fresh snapshot starts
+ * the next time the editor is idle, so a burst of edits restarts it once.
+ */
+void editorHighlightRestart(void) {
+    hlJob *job = E.hljob;
+    if (!job) return;
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    job->next = E.hldead;
+    E.hldead = job;
+    E.hljob = NULL;
+    E.hlrestart = 1;
+}
+
+/* editorHighlightInstall() installs res if its row still holds what the
+ * thread lexed and the row before ends in the state it assumed, otherwise
+ * lexes the row again. Returns 1 if the screen changed.
+ */
+int editorHighlightInstall(hlJob *job, hlResult *res) {
+    if (res->row >= E.numrows) return 0;
+    erow *row = &E.row[res->row];
+    int prev = res->row ? row[-1].hlstate : HL_STATE_NORMAL;
+    //if the row before isn't in yet, its result is checked against this one
+    if (prev == HL_STATE_UNKNOWN) prev = res->start;
+
+    if (row->stamp < job->snap->stamp && prev == res->start) {
+        if (!row->cold) editorHighlightSet(row, res->hl);
+        row->hlstart = res->start;
+        row->hlstate = res->end;
+    } else {
+        row->hlstate = editorHighlightState(row, prev);
+    }
+
+    //the row after may have been lexed from a different state
+    if (res->row + 1 < E.numrows && editorRowLexed(&row[1]) &&
+            row[1].hlstart != row->hlstate) {
+        editorUpdateSyntax(&row[1]);
+        return 1;
+    }
+    return res->row >= E.rowoff && res->row < E.rowoff + E.screenrows;
+}
+
+/* editorHighlightDrain() installs the results ready so far and tells the
+ * thread where the screen is. Returns 1 if the screen changed.
+ */
+int editorHighlightDrain(void) {
+    hlJob *job = E.hljob;
+    if (!job) return 0;
+    __atomic_store_n(&job->viewport, E.rowoff, __ATOMIC_RELAXED);
+
+    int redraw = 0;
+    unsigned tail = job->tail;
+    unsigned head = __atomic_load_n(&job->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+        hlResult *res = &job->ring[tail % KILO_HL_RING];
+        redraw |= editorHighlightInstall(job, res);
+        free(res->hl);
+    }
+    __atomic_store_n(&job->tail, tail, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&job->exited, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&job->head, __ATOMIC_ACQUIRE) == tail) {
+        editorHighlightFree(job);
+        E.hljob = NULL;
+    }
+    return redraw;
+}
+
+/* editorHighlightPoll() reaps abandoned passes, starts the pass a restart
+ * asked for and drains the current one. Returns 1 if the screen changed.
+ */
+int editorHighlightPoll(void) {
+    hlJob **pp = &E.hldead;
+    while (*pp) {
+        hlJob *job = *pp;
+        if (!__atomic_load_n(&job->exited, __ATOMIC_ACQUIRE)) {
+            pp = &job->next;
+            continue;
+        }
+        *pp = job->next;
+        editorHighlightFree(job);
+    }
+
+    if (E.hlrestart) {
+        E.hlrestart = 0;
+        if (!editorHighlightStart()) {
+            editorHighlightAll();
+            return 1;
+        }
+    }
+    return editorHighlightDrain();
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    int flags = UNDO_TYPED;
+    if (E.cy == E.numrows) {
+        editorAppendRow("", 0);
+        flags |= UNDO_CHAIN;
+    }
+    E.undo.next = flags;
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx++;
+}
+
+/*** undo ***/
+
+void editorUndoReserve(long long len) {
+    undoLog *u = &E.undo;
+    if (u->len + len <= u->cap) return;
+    u->cap = (u->len + len) * 2;
+    u->buf = realloc(u->buf, u->cap);
+}
+
+/* editorUndoTrim() drops the oldest entries once the log is over budget,
+ * down to half the budget so the memmove is amortized over many edits.
+ * The newest entry is kept as long as it fits the budget by itself.
+ */
+void editorUndoTrim(void) {
+    undoLog *u = &E.undo;
+    if (u->len <= u->budget) return;
+
+    long long cut = 0;
+    undoHdr h;
+    while (cut < u->last && u->len - cut > u->budget / 2) {
+        memcpy(&h, u->buf + cut, sizeof(h));
+        cut += sizeof(h) + h.len;
+    }
+    if (u->len - cut > u->budget) {
+        //even the newest entry is too big, so there's no history left
+        u->len = u->cur = 0;
+        u->last = -1;
+        return;
+    }
+    memmove(u->buf, u->buf + cut, u->len - cut);
+    u->len -= cut;
+    u->cur -= cut;
+    u->last -= cut;
+
+    memcpy(&h, u->buf, sizeof(h));
+    h.prevsize = 0;
+    h.flags &= ~UNDO_CHAIN;
+    memcpy(u->buf, &h, sizeof(h));
+}
+
+/* editorUndoRecord() is called by the row operations before each change.
+ * A typed character that continues the text of the last typed entry is
+ * appended to it instead of starting a new one.
+ */
+void editorUndoRecord(int op, int row, int col, const char *s, int len) {
+    undoLog *u = &E.undo;
+    int flags = u->next;
+    u->next = 0;
+    if (u->suspended) return;
+
+    undoHdr h;
+    if ((flags & UNDO_TYPED) && !(flags & UNDO_CHAIN) && op == UNDO_INSERT &&
+            u->last >= 0 && u->cur == u->len) {
+        memcpy(&h, u->buf + u->last, sizeof(h));
+        if (h.op == UNDO_INSERT && (h.flags & UNDO_TYPED) &&
+                h.row == row && h.col + h.len == col) {
+            editorUndoReserve(len);
+            memcpy(u->buf + u->len, s, len);
+            u->len += len;
+            u->cur = u->len;
+            h.len += len;
+            memcpy(u->buf + u->last, &h, sizeof(h));
+            editorUndoTrim();
+            return;
+        }
+    }
+
+    //a new edit makes whatever was undone unreachable
+    u->len = u->cur;
+
+    h.op = op;
+    h.flags = flags;
+    h.row = row;
+    h.col = col;
+    h.len = len;
+    h.prevsize = u->last >= 0 ? u->cur - u->last : 0;
+    editorUndoReserve(sizeof(h) + len);
+    memcpy(u->buf + u->len, &h, sizeof(h));
+    memcpy(u->buf + u->len + sizeof(h), s, len);
+    u->last = u->len;
+    u->len += sizeof(h) + len;
+    u->cur = u->len;
+    editorUndoTrim();
+}
+
+/* editorUndoApply() performs op, or its inverse, and puts the cursor at the
+ * position it affected.
+ */
+void editorUndoApply(undoHdr *h, const char *text, int inverse) {
+    int op = inverse ? h->op ^ 1 : h->op;
+
+    E.undo.suspended = 1;
+    E.cy = h->row;
+    E.cx = h->col;
+    switch (op) {
+        case UNDO_INSERT:
+            editorRowInsertString(&E.row[h->row], h->col, text, h->len);
+            E.cx += h->len;
+            break;
+        case UNDO_DELETE:
+            editorRowDeleteRange(&E.row[h->row], h->col, h->len);
+            break;
+        case UNDO_INSERT_ROW:
+            editorInsertRow(h->row, (char *)text, h->len);
+            break;
+        case UNDO_DELETE_ROW:
+            editorDelRow(h->row);
+            break;
+        case UNDO_REPLACE:
+        case UNDO_UNREPLACE:
+            editorReplaceApply(text, h->len, op == UNDO_UNREPLACE);
+            E.cx = 0;
+            break;
+    }
+    E.undo.suspended = 0;
+}
+
+void editorUndo(void) {
+    undoLog *u = &E.undo;
+    undoHdr h;
+
+    if (u->last < 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    long long t0 = editorTraceBegin();
+    do {
+        memcpy(&h, u->buf + u->last, sizeof(h));
+        editorUndoApply(&h, u->buf + u->last + sizeof(h), 1);
+        u->cur = u->last;
+        u->last = h.prevsize ? u->last - h.prevsize : -1;
+    } while ((h.flags & UNDO_CHAIN) && u->last >= 0);
+    editorTraceEnd("editorUpdateRow: undo", t0, -1);
+}
+
+void editorRedo(void) {
+    undoLog *u = &E.undo;
+    undoHdr h;
+
+    if (u->cur == u->len) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    long long t0 = editorTraceBegin();
+    do {
+        memcpy(&h, u->buf + u->cur, sizeof(h));
+        editorUndoApply(&h, u->buf + u->cur + sizeof(h), 0);
+        u->last = u->cur;
+        u->cur += sizeof(h) + h.len;
+        if (u->cur < u->len) memcpy(&h, u->buf + u->cur, sizeof(h));
+    } while (u->cur < u->len && (h.flags & UNDO_CHAIN));
+    editorTraceEnd("editorUpdateRow: redo", t0, -1);
+}
+
+/*** file i/o ***/
+
+void editorOpen(char *filename) {
+    long long t0 = editorTraceBegin();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+    E.hldefer = 1; //rows are highlighted once loaded and recovered
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    long long off = 0;
+
+    E.undo.suspended = 1;
+    E.disknl = 1;
+    E.diskcrlf = 0;
+    long long t1 = editorTraceBegin();
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        ssize_t rawlen = linelen;
+
+        //strip off \r\n at end of line
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r'))
+            linelen--;
+        if (linelen < rawlen && line[linelen] == '\r') E.diskcrlf = 1;
+
+        editorAppendRow(line,linelen);
+        E.row[E.numrows - 1].off = off;
+        E.row[E.numrows - 1].osize = linelen;
+        E.disknl = rawlen > 0 && line[rawlen - 1] == '\n';
+        off += rawlen;
+        //freeze as the file loads so it never has to fit in memory whole
+        if ((E.numrows & 1023) == 0) {
+            editorColdFreeze(LLONG_MAX, 0);
+            editorSpillEnforce();
+        }
+    }
+    free(line);
+    editorTraceEnd("editorUpdateRow: load", t1, E.numrows);
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0) {
+        E.disksize = st.st_size;
+        E.diskmtime = st.st_mtim;
+    }
+    fclose(fp);
+    E.diskrows = E.numrows;
+    E.dirty = 0;
+    editorJournalOpen();
+    editorIndexOpen();
+    editorHighlightOpen();
+    E.undo.suspended = 0;
+    editorTraceEnd("editorOpen", t0, -1);
+}
+
+/*** save ***/
+
+//a dirty row as it was when a save started, see editorSaveInPlace()
+typedef struct saverow {
+    int at;
+    long long off;
+    int osize;
+} saverow;
+
+//a save running on its own thread against a snapshot of the buffer
+//the main thread fills in everything up to `thread` and then only reads
+//`written` and `done` until the job is done
+typedef struct saveJob {
+    snapshot *snap;
+    char *filename;
+    int inplace;
+    saverow *dirty; //sorted by row
+    int ndirty;
+    int edits;      //E.dirty when the snapshot was taken
+    int diskrows;
+    long long disksize;
+    struct timespec diskmtime;
+    int disknl;
+    int diskcrlf;
+    long long total; //bytes in the snapshot, for progress
+    pthread_t thread;
+    long long jmark; //journal position the snapshot corresponds to
+    int reshaped;    //E.reshaped when the snapshot was taken
+    int threaded;    //thread must be joined
+    int shownpct;    //progress last shown in the status bar
+
+    //filled in by the save thread
+    long long written;
+    long long result; //bytes written, -1 on error, -2 not done in place
+    int err;
+    int shift;         //first row that was rewritten rather than patched
+    long long tailoff; //where that row now starts in the file
+    int tailnl;        //the rewrite left the file ending in a newline
+    int patched;       //saved in place rather than by a full rewrite
+    long long newsize;
+    struct timespec newmtime;
+    int done;
+} saveJob;
+
+/* editorWriteAll() writes out every iovec, resuming after short writes.
+ * Consumed iovecs are modified in place. Returns 0, or -1 with errno set.
+ */
+int editorWriteAll(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        //skip the fully written iovecs and trim the partially written one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* editorWriteRows() streams snapshot rows from `at` to the end to fd with
+ * writev(), KILO_SAVE_IOV iovecs at a time, so no copy of the buffer is
+ * ever built in memory. Returns bytes written, or -1 with errno set.
+ */
+long long editorWriteRows(saveJob *job, int fd, int at) {
+    snapshot *snap = job->snap;
+    struct iovec iov[KILO_SAVE_IOV];
+    long long base = job->written;
+    long long total = 0;
+    int j = at;
+    coldCache cc = {0};
+
+    while (j < snap->numrows) {
+        int cnt = 0, packed = 0; //the last iovec is unpacked text, newlines included
+        for (; j < snap->numrows && cnt + 2 <= KILO_SAVE_IOV; j++) {
+            snaprow *row = &snap->row[j];
+            if (row->cold) {
+                //unpacking the next block overwrites the text in the iovecs
+                if (cnt > 0 && !editorColdCached(&cc, row->cold)) break;
+                char *s = (char *)editorSnapChars(row, &cc);
+                if (!s) {
+                    int err = cc.err;
+                    editorColdCacheFree(&cc);
+                    errno = err;
+                    return -1;
+                }
+                if (packed && (char *)iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == s) {
+                    iov[cnt - 1].iov_len += row->size + 1;
+                } else {
+                    iov[cnt].iov_base = s;
+                    iov[cnt++].iov_len = row->size + 1;
+                }
+                packed = 1;
+            } else {
+                iov[cnt].iov_base = row->chars;
+                iov[cnt++].iov_len = row->size;
+                iov[cnt].iov_base = "\n";
+                iov[cnt++].iov_len = 1;
+                packed = 0;
+            }
+            total += row->size + 1;
+        }
+        if (editorWriteAll(fd, iov, cnt) == -1) {
+            editorColdCacheFree(&cc);
+            return -1;
+        }
+        __atomic_store_n(&job->written, base + total, __ATOMIC_RELAXED);
+    }
+    editorColdCacheFree(&cc);
+    return total;
+}
+
+int editorPwriteAll(int fd, const char *s, size_t len, long long off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, s, len, off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+int editorCmpSaveRow(const void *a, const void *b) {
+    int x = ((const saverow *)a)->at, y = ((const saverow *)b)->at;
+    return (x > y) - (x < y);
+}
+
+/* editorSaveInPlace() patches only the dirty rows of the file on disk, so the
+ * cost of a save follows the size of the edit rather than of the file.
+ * Rows whose length is unchanged are overwritten where they are. From the
+ * first row whose length changed, or the first new row, the rest of the file
+ * is rewritten and truncated, as long as that tail is no more than
+ * KILO_INPLACE_MAX_TAIL bytes before and after the save. Rows are written
+ * with \n, so a file with \r\n line endings always gets the full save,
+ * which turns it into \n throughout rather than mixing the two.
+ * Unlike editorSaveRows() this is not crash safe, hence it is opt-in.
+ * Returns bytes written, -1 with errno set on I/O error, or -2 when the
+ * edits can't be patched in place and a full save is needed.
+ */
+long long editorSaveInPlace(saveJob *job) {
+    snapshot *snap = job->snap;
+
+    if (job->disksize < 0 || snap->numrows < job->diskrows) return -2;
+    if (job->diskcrlf) return -2;
+    if (snap->numrows > job->diskrows && !job->disknl) return -2;
+
+    //refuse to patch a file that changed behind our back
+    struct stat st;
+    if (stat(job->filename, &st) == -1 || st.st_size != job->disksize ||
+            st.st_mtim.tv_sec != job->diskmtime.tv_sec ||
+            st.st_mtim.tv_nsec != job->diskmtime.tv_nsec)
+        return -2;
+
+    //find where lengths start to differ; everything after it must move
+    int shift = snap->numrows;
+    long long tailoff = job->disksize;
+    for (int j = 0; j < job->ndirty; j++) {
+        saverow *d = &job->dirty[j];
+        if (d->off == -1 || snap->row[d->at].size != d->osize) {
+            shift = d->at;
+            if (d->off != -1) tailoff = d->off;
+            break;
+        }
+    }
+    if (shift > job->diskrows) shift = job->diskrows; //appended rows start the tail
+
+    long long taillen = 0;
+    if (job->disksize - tailoff > KILO_INPLACE_MAX_TAIL) return -2;
+    for (int j = shift; j < snap->numrows; j++) {
+        taillen += snap->row[j].size + 1;
+        if (taillen > KILO_INPLACE_MAX_TAIL) return -2;
+    }
+
+    int fd = open(job->filename, O_WRONLY);
+    if (fd == -1) return -1;
+
+    long long total = 0;
+    int err = 0;
+    coldCache cc = {0};
+    for (int j = 0; !err && j < job->ndirty && job->dirty[j].at < shift; j++) {
+        snaprow *row = &snap->row[job->dirty[j].at];
+        const char *text = editorSnapChars(row, &cc);
+        if (!text) err = cc.err;
+        else if (editorPwriteAll(fd, text, row->size, job->dirty[j].off) == -1) err = errno;
+        total += row->size;
+    }
+    editorColdCacheFree(&cc);
+    __atomic_store_n(&job->written, total, __ATOMIC_RELAXED);
+    if (!err && shift < snap->numrows) {
+        if (lseek(fd, tailoff, SEEK_SET) == -1 ||
+                editorWriteRows(job, fd, shift) == -1)
+            err = errno;
+        total += taillen;
+    }
+    if (!err && ftruncate(fd, tailoff + taillen) == -1) err = errno;
+    if (!err && fdatasync(fd) == -1) err = errno;
+    if (close(fd) == -1 && !err) err = errno;
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    job->shift = shift;
+    job->tailoff = tailoff;
+    job->tailnl = shift < snap->numrows || job->disknl;
+    job->patched = 1;
+    return total;
+}
+
+/* editorSaveRows() writes the snapshot to a temp file next to the target,
+ * fsyncs it and renames it over the target so a crash never leaves a half
+ * written file. Returns bytes written, or -1 with errno set.
+ */
+long long editorSaveRows(saveJob *job) {
+    const char *filename = job->filename;
+    size_t flen = strlen(filename);
+    char *tmp = malloc(flen + sizeof(".kilo-XXXXXX"));
+    memcpy(tmp, filename, flen);
+    memcpy(tmp + flen, ".kilo-XXXXXX", sizeof(".kilo-XXXXXX"));
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+
+    //keep the permissions of the file being replaced
+    struct stat st;
+    mode_t mode = 0644;
+    if (stat(filename, &st) == 0) mode = st.st_mode & 07777;
+
+    long long total = 0;
+    int err = 0;
+
+    if (fchmod(fd, mode) == -1) err = errno;
+    if (!err && (total = editorWriteRows(job, fd, 0)) == -1) err = errno;
+
+    if (!err && fsync(fd) == -1) err = errno;
+    if (close(fd) == -1 && !err) err = errno;
+    if (!err && rename(tmp, filename) == -1) err = errno;
+
+    if (err) {
+        unlink(tmp);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+
+    //fsync the directory so the rename itself is durable
+    char *slash = strrchr(tmp, '/');
+    if (slash) {
+        slash[slash == tmp ? 1 : 0] = '\0';
+    } else {
+        tmp[0] = '.';
+        tmp[1] = '\0';
+    }
+    int dfd = open(tmp, O_RDONLY | O_DIRECTORY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(tmp);
+
+    job->shift = 0;
+    job->tailoff = 0;
+    job->tailnl = 1;
+    return total;
+}
+
+void *editorSaveThread(void *arg) {
+    saveJob *job = arg;
+
+    long long len = job->inplace ? editorSaveInPlace(job) : -2;
+    if (len == -2) len = editorSaveRows(job);
+    job->result = len;
+    job->err = errno;
+
+    struct stat st;
+    job->newsize = -1;
+    if (len != -1 && stat(job->filename, &st) == 0) {
+        job->newsize = st.st_size;
+        job->newmtime = st.st_mtim;
+    }
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* editorSaveFinish() joins a finished save and folds its outcome back into
+ * the live buffer, which may have been edited while the save was running.
+ */
+void editorSaveFinish(void) {
+    saveJob *job = E.save;
+    snapshot *snap = job->snap;
+
+    if (job->threaded) pthread_join(job->thread, NULL);
+    E.save = NULL;
+
+    if (job->result == -1) {
+        //rows saved from the dirty list are still dirty
+        for (int j = 0; j < job->ndirty; j++)
+            if (job->dirty[j].at < E.numrows)
+                editorRowMarkDirty(&E.row[job->dirty[j].at]);
+        if (job->inplace || E.reshaped != job->reshaped)
+            E.disksize = -1; //a failed patch leaves junk on disk
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    } else {
+        //record where the rewritten rows now live in the file
+        long long off = job->tailoff;
+        int n = snap->numrows < E.numrows ? snap->numrows : E.numrows;
+        for (int j = job->shift; j < n; j++) {
+            E.row[j].off = off;
+            E.row[j].osize = snap->row[j].size;
+            off += snap->row[j].size + 1;
+        }
+        E.diskrows = snap->numrows;
+        E.disknl = job->tailnl;
+        E.diskcrlf = 0;
+        E.disksize = job->newsize;
+        E.diskmtime = job->newmtime;
+        //rows moved while saving, the offsets above went to the wrong rows
+        if (E.reshaped != job->reshaped) E.disksize = -1;
+        E.dirty -= job->edits;
+        editorJournalRebase(job->jmark, job->newsize, job->newmtime);
+        editorSetStatusMessage("%lld bytes %s", job->result,
+                job->patched ? "patched in place" : "written to disk");
+    }
+
+    editorSnapshotRelease(snap);
+    free(job->dirty);
+    free(job->filename);
+    free(job);
+}
+
+/* editorSavePoll() is called while waiting for input. It reports progress
+ * of a running save and finishes it once done. Returns 1 if the status
+ * message changed.
+ */
+int editorSavePoll(void) {
+    saveJob *job = E.save;
+    if (!job) return 0;
+
+    if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        editorSaveFinish();
+        return 1;
+    }
+    long long written = __atomic_load_n(&job->written, __ATOMIC_RELAXED);
+    int pct = job->total ? written * 100 / job->total : 0;
+    if (pct == job->shownpct) return 0;
+    job->shownpct = pct;
+    editorSetStatusMessage("Saving... %d%%", pct);
+    return 1;
+}
+
+/* editorSaveWait() blocks until a running save is done, e.g. before exit.
+ */
+void editorSaveWait(void) {
+    if (E.save) editorSaveFinish();
+}
+
+/* editorSave() snapshots the buffer and hands it to a save thread, so a slow
+ * disk never stalls typing. The dirty list moves into the job; rows edited
+ * while the save runs are marked dirty again.
+ */
+void editorSave() {
+    if (E.filename == NULL) {
+        editorSetStatusMessage("No file name, nothing saved");
+        return;
+    }
+    if (E.save) {
+        editorSetStatusMessage("A save is already in progress");
+        return;
+    }
+
+    saveJob *job = calloc(1, sizeof(saveJob));
+    job->snap = editorSnapshotTake();
+    job->filename = strdup(E.filename);
+    job->inplace = E.inplace;
+    job->edits = E.dirty;
+    job->jmark = editorJournalMark();
+    job->reshaped = E.reshaped;
+    job->diskrows = E.diskrows;
+    job->disksize = E.disksize;
+    job->diskmtime = E.diskmtime;
+    job->disknl = E.disknl;
+    job->diskcrlf = E.diskcrlf;
+    job->total = editorRowBytes();
+
+    job->dirty = malloc(sizeof(saverow) * (E.ndirtyrows + 1));
+    for (int j = 0; j < E.ndirtyrows; j++) {
+        erow *row = &E.row[E.dirtyrows[j]];
+        if (E.dirtyrows[j] >= E.numrows) continue;
+        row->flags &= ~ROW_DIRTY;
+        job->dirty[job->ndirty].at = E.dirtyrows[j];
+        job->dirty[job->ndirty].off = row->off;
+        job->dirty[job->ndirty++].osize = row->osize;
+    }
+    qsort(job->dirty, job->ndirty, sizeof(saverow), editorCmpSaveRow);
+    free(E.dirtyrows);
+    E.dirtyrows = NULL;
+    E.ndirtyrows = 0;
+
+    E.save = job;
+    editorSetStatusMessage("Saving...");
+    job->threaded = pthread_create(&job->thread, NULL, editorSaveThread, job) == 0;
+    if (!job->threaded) {
+        //no thread to be had, save synchronously rather than not at all
+        editorSaveThread(job);
+        editorSaveFinish();
+    }
+}
+
+/*** journal ***/
+
+//The journal is an append-only swap file holding the edits made since the
+//file was last saved. Edits are encoded into an in-memory buffer on the
+//main thread; a flusher thread writes and fdatasyncs that buffer at most
+//every KILO_JOURNAL_SYNC_MS, so a keypress never waits on the disk. The
+//flusher also does the rewrite a save asks for, see editorJournalRebase().
+//If kilo dies, the next editorOpen() of the same file replays it.
+
+#define JRN_MAGIC "KILOJRN1"
+#define JRN_HDR 32 //magic, then size and mtime (sec, nsec) of the base file
+#define JRN_REC 13 //op, row, col, len; followed by len bytes
+
+typedef struct journal {
+    int fd;
+    char *path;
+    pthread_t thread;
+    long long base; //pos of the first record in the file, flusher only
+    pthread_mutex_t lock;   //guards everything below
+    pthread_cond_t cond;
+    char *buf;      //records not yet written
+    int len;
+    int cap;
+    char *spare;    //buffer being written by the flusher
+    int sparecap;
+    long long pos;  //bytes of records since the journal was opened, written or not
+    int rebase;     //a rebase is asked for: drop records before rebasemark
+    long long rebasemark;
+    char rebasehdr[JRN_HDR];
+    int err;        //errno of a write that failed; nothing is written after it
+    int reported;   //err was shown, main thread only
+    int stop;
+} journal;
+
+/* editorJournalPath() returns "dir/.name.kswp" for "dir/name".
+ */
+char *editorJournalPath(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    size_t dirlen = base - filename;
+    char *path = malloc(strlen(filename) + sizeof("..kswp"));
+    memcpy(path, filename, dirlen);
+    sprintf(path + dirlen, ".%s.kswp", base);
+    return path;
+}
+
+/* editorJournalLock() opens the swap file at path and takes an exclusive
+ * lock on it, so two kilos editing the same file don't journal into one.
+ * Returns -1 with errno EWOULDBLOCK if another one holds it.
+ */
+int editorJournalLock(const char *path) {
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd == -1) return -1;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+
+        //the holder may have replaced or removed the file before letting go
+        struct stat a, b;
+        if (fstat(fd, &a) == -1 || (stat(path, &b) == 0 &&
+                    a.st_dev == b.st_dev && a.st_ino == b.st_ino))
+            return fd;
+        close(fd);
+    }
+}
+
+void editorJournalHeader(char *hdr, long long size, struct timespec mtime) {
+    long long sec = mtime.tv_sec, nsec = mtime.tv_nsec;
+    memcpy(hdr, JRN_MAGIC, 8);
+    memcpy(hdr + 8, &size, 8);
+    memcpy(hdr + 16, &sec, 8);
+    memcpy(hdr + 24, &nsec, 8);
+}
+
+/* editorJournalAppend() queues one edit. Called on every buffer mutation,
+ * it costs a mutex and a memcpy of JRN_REC + len bytes.
+ */
+void editorJournalAppend(int op, int row, int col, const char *s, int len) {
+    journal *j = E.journal;
+    if (!j) return;
+
+    pthread_mutex_lock(&j->lock);
+    if (j->err) {
+        pthread_mutex_unlock(&j->lock);
+        return;
+    }
+    if (j->len + JRN_REC + len > j->cap) {
+        j->cap = (j->cap + JRN_REC + len) * 2;
+        j->buf = realloc(j->buf, j->cap);
+    }
+    char *p = j->buf + j->len;
+    uint32_t fields[3] = { row, col, len };
+    p[0] = op;
+    memcpy(p + 1, fields, sizeof(fields));
+    memcpy(p + JRN_REC, s, len);
+    j->len += JRN_REC + len;
+    j->pos += JRN_REC + len;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* editorJournalRewrite() keeps only the records from mark on, behind the
+ * header hdr. The new journal is written and fsynced beside the old one
+ * and renamed over it, so a crash leaves one or the other whole; should it
+ * be the old one, its header no longer matches and the next open moves it
+ * aside. Runs on the flusher, after everything queued was written.
+ * Returns 0, or -1 with errno set.
+ */
+int editorJournalRewrite(journal *j, long long mark, const char *hdr) {
+    off_t end = lseek(j->fd, 0, SEEK_END);
+    if (end == -1) return -1;
+    long long from = JRN_HDR + mark - j->base;
+    long long tail = end - from;
+    if (tail < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *buf = malloc(JRN_HDR + tail);
+    size_t plen = strlen(j->path);
+    char *tmp = malloc(plen + sizeof(".XXXXXX"));
+    memcpy(tmp, j->path, plen);
+    memcpy(tmp + plen, ".XXXXXX", sizeof(".XXXXXX"));
+    memcpy(buf, hdr, JRN_HDR);
+
+    int fd = -1, err = 0;
+    if (pread(j->fd, buf + JRN_HDR, tail, from) == tail &&
+            (fd = mkstemp(tmp)) != -1 &&
+            flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+            pwrite(fd, buf, JRN_HDR + tail, 0) == JRN_HDR + tail &&
+            lseek(fd, 0, SEEK_END) != -1 &&
+            fsync(fd) == 0 &&
+            rename(tmp, j->path) == 0) {
+        close(j->fd);
+        j->fd = fd;
+        j->base = mark;
+    } else {
+        err = errno ? errno : EIO; //short reads and writes leave errno alone
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(buf);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+/* editorJournalThread() is the group commit loop: whatever was queued
+ * since the last round is written with one write() and one fdatasync(),
+ * then a rebase asked for meanwhile is carried out. After a failure the
+ * file is cut back to its last whole record and no more is written, for
+ * editorJournalPoll() to report.
+ */
+void *editorJournalThread(void *arg) {
+    journal *j = arg;
+    int stop = 0;
+
+    while (!stop) {
+        pthread_mutex_lock(&j->lock);
+        if (!j->stop && j->len == 0 && !j->rebase) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += KILO_JOURNAL_SYNC_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+            pthread_mutex_unlock(&j->lock);
+            continue;
+        }
+        stop = j->stop;
+        int failed = j->err != 0;
+        int rebase = j->rebase;
+        long long mark = j->rebasemark;
+        char hdr[JRN_HDR];
+        memcpy(hdr, j->rebasehdr, JRN_HDR);
+        j->rebase = 0;
+
+        //swap buffers so the main thread can keep appending while we write
+        char *b = j->buf;
+        int n = j->len;
+        int cap = j->cap;
+        j->buf = j->spare;
+        j->cap = j->sparecap;
+        j->len = 0;
+        j->spare = b;
+        j->sparecap = cap;
+        pthread_mutex_unlock(&j->lock);
+
+        int err = 0;
+        if (n && !failed) {
+            off_t at = lseek(j->fd, 0, SEEK_END);
+            struct iovec iov = { b, n };
+            if (editorWriteAll(j->fd, &iov, 1) == -1 || fdatasync(j->fd) == -1) {
+                err = errno;
+                //no torn record for a replay to trip over
+                if (at != -1 && ftruncate(j->fd, at) == 0) lseek(j->fd, at, SEEK_SET);
+            }
+        }
+        if (rebase && !failed && !err && editorJournalRewrite(j, mark, hdr) == -1)
+            err = errno;
+        if (err) {
+            pthread_mutex_lock(&j->lock);
+            j->err = err;
+            j->len = 0;
+            pthread_mutex_unlock(&j->lock);
+        }
+
+        if (!stop) {
+            struct timespec ts = { 0, KILO_JOURNAL_SYNC_MS * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* editorJournalReplay() applies the records in buf to the freshly loaded
+ * buffer. Stops at the first record that is truncated or doesn't fit the
+ * buffer, which is what a crash in the middle of a write leaves behind.
+ * Returns the number of bytes of valid records.
+ */
+long long editorJournalReplay(const char *buf, long long len, int *edits) {
+    long long off = 0;
+
+    *edits = 0;
+    while (len - off >= JRN_REC) {
+        uint32_t fields[3];
+        memcpy(fields, buf + off + 1, sizeof(fields));
+        int op = buf[off];
+        uint32_t row = fields[0], col = fields[1], n = fields[2];
+        const char *s = buf + off + JRN_REC;
+
+        if ((unsigned long long)(len - off - JRN_REC) < n) break;
+        if (op == JRN_INSERT) {
+            if (row >= (uint32_t)E.numrows || col > (uint32_t)E.row[row].size) break;
+            editorRowInsertString(&E.row[row], col, s, n);
+        } else if (op == JRN_INSERT_ROW) {
+            if (row > (uint32_t)E.numrows) break;
+            editorInsertRow(row, (char *)s, n);
+        } else if (op == JRN_DELETE) {
+            if (row >= (uint32_t)E.numrows || col + n > (uint32_t)E.row[row].size) break;
+            editorRowDeleteRange(&E.row[row], col, n);
+        } else if (op == JRN_DELETE_ROW) {
+            if (row >= (uint32_t)E.numrows) break;
+            editorDelRow(row);
+        } else if (op == JRN_REPLACE) {
+            if (!editorReplaceCheck(s, n, col)) break;
+            editorReplaceApply(s, n, col);
+        } else {
+            break;
+        }
+        off += JRN_REC + n;
+        (*edits)++;
+    }
+    return off;
+}
+
+/* editorJournalOpen() is called once the file is loaded. A swap file left
+ * behind for this exact version of the file is replayed and extended; one
+ * for any other version is renamed to .name.kswp.1 and a fresh journal
+ * started. A swap file another kilo has locked is left alone and this
+ * session goes without one.
+ */
+void editorJournalOpen(void) {
+    char hdr[JRN_HDR], want[JRN_HDR];
+    char *path = editorJournalPath(E.filename);
+    long long pos = 0;
+
+    editorJournalHeader(want, E.disksize, E.diskmtime);
+    int fd = editorJournalLock(path);
+    if (fd == -1) {
+        editorSetStatusMessage("No swap file, edits won't survive a crash: %s",
+                errno == EWOULDBLOCK ? "in use by another kilo" : strerror(errno));
+        free(path);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= JRN_HDR &&
+            pread(fd, hdr, JRN_HDR, 0) == JRN_HDR) {
+        if (memcmp(hdr, want, JRN_HDR) == 0) {
+            long long len = st.st_size - JRN_HDR;
+            char *buf = malloc(len + 1);
+            int edits;
+            if (pread(fd, buf, len, JRN_HDR) == len) {
+                pos = editorJournalReplay(buf, len, &edits);
+                if (edits)
+                    editorSetStatusMessage("Recovered %d edits from %s", edits, path);
+            }
+            free(buf);
+        } else if (st.st_size > JRN_HDR) {
+            //edits against some other version of the file, perhaps all
+            //that is left of a crashed session: move them aside, not over
+            char *old = malloc(strlen(path) + sizeof(".1"));
+            sprintf(old, "%s.1", path);
+            if (rename(path, old) == -1) {
+                editorSetStatusMessage("No swap file, can't move stale %s aside: %s",
+                        path, strerror(errno));
+                close(fd);
+                free(old);
+                free(path);
+                return;
+            }
+            editorSetStatusMessage("Stale swap file kept as %s", old);
+            free(old);
+            close(fd);
+            if ((fd = editorJournalLock(path)) == -1) {
+                free(path);
+                return;
+            }
+        }
+    }
+
+    //drop a torn tail record and (re)write the header
+    if (ftruncate(fd, JRN_HDR + pos) == -1 ||
+            pwrite(fd, want, JRN_HDR, 0) != JRN_HDR ||
+            lseek(fd, 0, SEEK_END) == -1) {
+        close(fd);
+        free(path);
+        return;
+    }
+
+    journal *j = calloc(1, sizeof(journal));
+    j->fd = fd;
+    j->path = path;
+    j->pos = pos;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    if (pthread_create(&j->thread, NULL, editorJournalThread, j) != 0) {
+        close(fd);
+        free(path);
+        free(j);
+        return;
+    }
+    E.journal = j;
+}
+
+long long editorJournalMark(void) {
+    journal *j = E.journal;
+    if (!j) return 0;
+    pthread_mutex_lock(&j->lock);
+    long long pos = j->pos;
+    pthread_mutex_unlock(&j->lock);
+    return pos;
+}
+
+/* editorJournalRebase() is called after a save of the buffer as it was at
+ * journal position mark. Records before mark are now on disk, so the
+ * flusher is asked to keep only the ones after it, behind a header for the
+ * newly written file; the main thread doesn't wait for that.
+ */
+void editorJournalRebase(long long mark, long long size, struct timespec mtime) {
+    journal *j = E.journal;
+    if (!j) return;
+
+    pthread_mutex_lock(&j->lock);
+    j->rebase = 1;
+    j->rebasemark = mark;
+    editorJournalHeader(j->rebasehdr, size, mtime);
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* editorJournalPoll() reports, once, that the journal couldn't be written.
+ * Returns 1 if the status message changed.
+ */
+int editorJournalPoll(void) {
+    journal *j = E.journal;
+    if (!j || j->reported) return 0;
+
+    pthread_mutex_lock(&j->lock);
+    int err = j->err;
+    pthread_mutex_unlock(&j->lock);
+    if (!err) return 0;
+    j->reported = 1;
+    editorSetStatusMessage("Can't write swap file, edits won't survive a crash: %s",
+            strerror(err));
+    return 1;
+}
+
+/* editorJournalClose() flushes and stops the journal. The swap file is
+ * removed unless keep is set, e.g. when there are unsaved edits.
+ */
+void editorJournalClose(int keep) {
+    journal *j = E.journal;
+    if (!j) return;
+    E.journal = NULL;
+
+    pthread_mutex_lock(&j->lock);
+    j->stop = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->thread, NULL);
+
+    //unlink while still holding the lock, so nobody takes over the old file
+    if (!keep) unlink(j->path);
+    close(j->fd);
+    free(j->path);
+    free(j->buf);
+    free(j->spare);
+    free(j);
+}
+
+/*** index ***/
+
+//With KILO_INDEX set, a trigram index of the buffer is built in the
+//background after a file is opened. Each bucket of trigrams holds a posting
+//list of the ids of rows containing them; ids are stable while rows move,
+//and index->where maps them back to rows. Edits only ever add postings, so
+//a list may name rows that no longer contain the trigram: candidates are
+//always verified by the matcher.
+typedef struct trigramList {
+    uint32_t *ids;
+    uint32_t len, cap;
+    uint32_t nsorted; //ids[0..nsorted) are sorted and unique
+} trigramList;
+
+typedef struct trigramIndex {
+    trigramList *list;  //KILO_INDEX_BUCKETS lists, NULL while building
+    int *where;         //row id -> row index, -1 once deleted
+    unsigned nwhere;
+    pthread_t thread;
+    snapshot *snap;     //rows the thread indexes
+    unsigned *snapids;  //their ids
+    trigramList *built; //the thread's lists, ready once done is set
+    int done;
+    int err;            //why built is NULL: rows the thread couldn't read
+    unsigned *pending;  //rows changed while building
+    int npending;
+    uint32_t *ids;      //scratch for lookups
+    int *cand;          //rows found by the last lookup
+    uint32_t candcap;
+    long long bytes;    //of the buckets and their lists
+} trigramIndex;
+
+unsigned editorTrigramBucket(const char *s) {
+    uint32_t t = (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2];
+    return (t * 2654435761u) >> (32 - KILO_INDEX_BITS);
+}
+
+/* editorIndexListAdd() appends id to l. Returns the bytes l grew by.
+ */
+int editorIndexListAdd(trigramList *l, uint32_t id) {
+    int grew = 0;
+    if (l->len && l->ids[l->len - 1] == id) return 0;
+    if (l->len == l->cap) {
+        grew = sizeof(uint32_t) * (l->cap ? l->cap : 4);
+        l->cap = l->cap ? l->cap * 2 : 4;
+        l->ids = realloc(l->ids, sizeof(uint32_t) * l->cap);
+    }
+    if (l->nsorted == l->len && (l->len == 0 || id > l->ids[l->len - 1])) l->nsorted++;
+    l->ids[l->len++] = id;
+    return grew;
+}
+
+long long editorIndexAdd(trigramList *lists, uint32_t id, const char *s, int len) {
+    long long grew = 0;
+    for (int j = 0; j + 3 <= len; j++)
+        grew += editorIndexListAdd(&lists[editorTrigramBucket(s + j)], id);
+    return grew;
+}
+
+int editorIndexCmpId(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* editorIndexListSort() merges the ids appended out of order by edits
+ * into the sorted part of l, dropping duplicates.
+ */
+void editorIndexListSort(trigramList *l) {
+    if (l->nsorted == l->len) return;
+
+    uint32_t *tail = l->ids + l->nsorted;
+    uint32_t ntail = l->len - l->nsorted;
+    qsort(tail, ntail, sizeof(uint32_t), editorIndexCmpId);
+
+    uint32_t *ids = malloc(sizeof(uint32_t) * l->len);
+    uint32_t i = 0, j = 0, n = 0;
+    while (i < l->nsorted || j < ntail) {
+        uint32_t id;
+        if (j == ntail || (i < l->nsorted && l->ids[i] <= tail[j])) id = l->ids[i++];
+        else id = tail[j++];
+        if (n == 0 || ids[n - 1] != id) ids[n++] = id;
+    }
+    free(l->ids);
+    E.index->bytes -= sizeof(uint32_t) * ((long long)l->cap - n);
+    l->ids = ids;
+    l->len = l->nsorted = l->cap = n;
+}
+
+int editorIndexListHas(trigramList *l, uint32_t id) {
+    uint32_t lo = 0, hi = l->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (l->ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < l->len && l->ids[lo] == id;
+}
+
+void *editorIndexThread(void *arg) {
+    trigramIndex *index = arg;
+    trigramList *lists = calloc(1 << KILO_INDEX_BITS, sizeof(trigramList));
+    long long bytes = sizeof(trigramList) << KILO_INDEX_BITS;
+    coldCache cc = {0};
+
+    for (int j = 0; j < index->snap->numrows; j++) {
+        const char *s = editorSnapChars(&index->snap->row[j], &cc);
+        if (!s) {
+            //a row missing from the index would never be found through it
+            for (int k = 0; k < 1 << KILO_INDEX_BITS; k++) free(lists[k].ids);
+            free(lists);
+            lists = NULL;
+            index->err = cc.err;
+            break;
+        }
+        bytes += editorIndexAdd(lists, index->snapids[j], s, index->snap->row[j].size);
+    }
+    editorColdCacheFree(&cc);
+    index->bytes = bytes;
+    index->built = lists;
+    __atomic_store_n(&index->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* editorIndexOpen() starts building the index of the rows just loaded.
+ */
+void editorIndexOpen(void) {
+    if (!getenv("KILO_INDEX")) return;
+
+    trigramIndex *index = calloc(1, sizeof(trigramIndex));
+    index->nwhere = E.nextrowid + 1;
+    index->where = malloc(sizeof(int) * index->nwhere);
+    memset(index->where, -1, sizeof(int) * index->nwhere);
+    index->snap = editorSnapshotTake();
+    index->snapids = malloc(sizeof(unsigned) * (E.numrows + 1));
+    for (int j = 0; j < E.numrows; j++) {
+        index->where[E.row[j].id] = j;
+        index->snapids[j] = E.row[j].id;
+    }
+    if (pthread_create(&index->thread, NULL, editorIndexThread, index) != 0) {
+        editorSnapshotRelease(index->snap);
+        free(index->snapids);
+        free(index->where);
+        free(index);
+        return;
+    }
+    E.index = index;
+}
+
+/* editorIndexRow() indexes row after it was inserted or changed. While the
+ * index is still being built, the row is indexed once it is done.
+ */
+void editorIndexRow(erow *row) {
+    trigramIndex *index = E.index;
+    if (!index) return;
+
+    if (row->id >= index->nwhere) {
+        unsigned n = index->nwhere * 2 > row->id ? index->nwhere * 2 : row->id + 1;
+        index->where = realloc(index->where, sizeof(int) * n);
+        memset(index->where + index->nwhere, -1, sizeof(int) * (n - index->nwhere));
+        index->nwhere = n;
+    }
+    index->where[row->id] = row - E.row;
+
+    if (!index->list) {
+        index->pending = realloc(index->pending, sizeof(unsigned) * (index->npending + 1));
+        index->pending[index->npending++] = row->id;
+        return;
+    }
+    index->bytes += editorIndexAdd(index->list, row->id,
+            editorRowChars(row, &E.coldcache), row->size);
+}
+
+/* editorIndexRowsMoved() updates where rows [from, to) now are.
+ */
+void editorIndexRowsMoved(int from, int to) {
+    if (!E.index) return;
+    for (int j = from; j < to; j++) E.index->where[E.row[j].id] = j;
+}
+
+void editorIndexForget(erow *row) {
+    if (E.index) E.index->where[row->id] = -1;
+}
+
+/* editorIndexPoll() adopts the index once the thread has built it, or
+ * drops it if the thread couldn't. Returns 1 if the status message changed.
+ */
+int editorIndexPoll(void) {
+    trigramIndex *index = E.index;
+    if (!index || index->list || !__atomic_load_n(&index->done, __ATOMIC_ACQUIRE))
+        return 0;
+
+    pthread_join(index->thread, NULL);
+    editorSnapshotRelease(index->snap);
+    free(index->snapids);
+    index->snap = NULL;
+    index->snapids = NULL;
+    if (!index->built) {
+        editorSetStatusMessage("No search index, rows can't be read back: %s",
+                strerror(index->err));
+        free(index->where);
+        free(index->pending);
+        free(index);
+        E.index = NULL;
+        return 1;
+    }
+    index->list = index->built;
+    for (int j = 0; j < index->npending; j++) {
+        int at = index->where[index->pending[j]];
+        if (at != -1) editorIndexRow(&E.row[at]);
+    }
+    free(index->pending);
+    index->pending = NULL;
+    index->npending = 0;
+    editorSetStatusMessage("Search index ready");
+    return 1;
+}
+
+int editorIndexCmpLen(const void *a, const void *b) {
+    uint32_t x = (*(trigramList * const *)a)->len, y = (*(trigramList * const *)b)->len;
+    return (x > y) - (x < y);
+}
+
+/* editorIndexLookup() finds the rows that may contain q, in ascending
+ * order, in index->cand. Returns how many, or -1 if the index can't tell.
+ */
+int editorIndexLookup(const char *q, int qlen) {
+    trigramIndex *index = E.index;
+    if (!index || !index->list || qlen < 3) return -1;
+
+    //intersect the lists of every trigram, shortest first so the
+    //candidates are few by the time the long lists are probed
+    int nlists = qlen - 2;
+    trigramList **lists = malloc(sizeof(trigramList *) * nlists);
+    for (int j = 0; j < nlists; j++) {
+        lists[j] = &index->list[editorTrigramBucket(q + j)];
+        editorIndexListSort(lists[j]);
+    }
+    qsort(lists, nlists, sizeof(trigramList *), editorIndexCmpLen);
+
+    uint32_t n = lists[0]->len;
+    if (n > index->candcap) {
+        index->candcap = n;
+        index->ids = realloc(index->ids, sizeof(uint32_t) * n);
+        index->cand = realloc(index->cand, sizeof(int) * n);
+    }
+    memcpy(index->ids, lists[0]->ids, sizeof(uint32_t) * n);
+    for (int j = 1; j < nlists && n > 0; j++) {
+        if (lists[j] == lists[j - 1]) continue;
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < n; i++)
+            if (editorIndexListHas(lists[j], index->ids[i])) index->ids[kept++] = index->ids[i];
+        n = kept;
+    }
+    free(lists);
+
+    int ncand = 0;
+    for (uint32_t i = 0; i < n; i++)
+        if (index->where[index->ids[i]] != -1) index->cand[ncand++] = index->where[index->ids[i]];
+    qsort(index->cand, ncand, sizeof(int), editorIndexCmpId);
+    return ncand;
+}
+
+/*** regex ***/
+
+//A small regex engine for search: literals, ., [...] classes, \d \w \s and
+//their negations, ^ $, * + ?, | and (). A pattern is parsed into a tree and
+//compiled into Thompson NFAs, which are run as a lazily built DFA over
+//byte classes: matching is linear in the input, with no backtracking.
+//Match starts are found by running the reversed pattern backwards over a
+//row, then the longest match from a start is found with a forward pass.
+
+enum reNodeType { RE_SET, RE_EMPTY, RE_BOL, RE_EOL, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST };
+enum reStateType { NFA_SET, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+typedef struct reNode {
+    int type;
+    int a, b; //children
+    int set;  //RE_SET: index into sets
+} reNode;
+
+typedef struct nfaState {
+    int type;
+    int set;      //NFA_SET: bytes that take the out edge
+    int out, out1;
+} nfaState;
+
+typedef struct nfa {
+    nfaState *state;
+    int nstates;
+    int start;
+} nfa;
+
+typedef struct regex {
+    uint32_t (*sets)[8]; //256-bit byte sets
+    int nsets;
+    unsigned char classes[256]; //byte -> class; bytes in a class never differ in any set
+    unsigned char rep[256];     //a byte of each class
+    int nclasses;
+    nfa fwd, rev;
+    char prefix[64];  //literal every match starts with
+    int prefixlen;
+} regex;
+
+typedef struct reParser {
+    const char *p;
+    reNode *node;
+    int nnodes;
+    regex *re;
+    int err;
+} reParser;
+
+int reNodeNew(reParser *ps, int type, int a, int b) {
+    ps->node = realloc(ps->node, sizeof(reNode) * (ps->nnodes + 1));
+    ps->node[ps->nnodes].type = type;
+    ps->node[ps->nnodes].a = a;
+    ps->node[ps->nnodes].b = b;
+    ps->node[ps->nnodes].set = -1;
+    return ps->nnodes++;
+}
+
+int reSetNew(reParser *ps) {
+    regex *re = ps->re;
+    re->sets = realloc(re->sets, sizeof(*re->sets) * (re->nsets + 1));
+    memset(re->sets[re->nsets], 0, sizeof(*re->sets));
+    int n = reNodeNew(ps, RE_SET, -1, -1);
+    ps->node[n].set = re->nsets++;
+    return n;
+}
+
+void reSetAdd(uint32_t *set, int c) {
+    set[(unsigned char)c >> 5] |= 1u << (c & 31);
+}
+
+int reSetHas(const uint32_t *set, int c) {
+    return (set[c >> 5] >> (c & 31)) & 1;
+}
+
+/* reSetEscape() adds the bytes of a \d, \w or \s style escape to set.
+ * Returns 0 if c isn't a class escape.
+ */
+int reSetEscape(uint32_t *set, int c) {
+    int neg = isupper(c);
+    int (*is)(int) = NULL;
+
+    switch (tolower(c)) {
+        case 'd': is = isdigit; break;
+        case 's': is = isspace; break;
+        case 'w': is = isalnum; break;
+        default: return 0;
+    }
+    for (int b = 0; b < 256; b++)
+        if ((is(b) || (tolower(c) == 'w' && b == '_')) != neg) reSetAdd(set, b);
+    return 1;
+}
+
+int reEscapeChar(int c) {
+    switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        default: return c;
+    }
+}
+
+int reParseAlt(reParser *ps);
+
+int reParseClass(reParser *ps) {
+    int n = reSetNew(ps);
+    uint32_t *set = ps->re->sets[ps->node[n].set];
+    int neg = 0;
+
+    if (*ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    //a ] right after [ or [^ is a literal
+    for (int first = 1; *ps->p && (first || *ps->p != ']'); first = 0) {
+        int c = (unsigned char)*ps->p++;
+        if (c == '\\' && *ps->p) {
+            c = (unsigned char)*ps->p++;
+            if (reSetEscape(set, c)) continue;
+            c = reEscapeChar(c);
+        }
+        int hi = c;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) hi = reEscapeChar((unsigned char)*ps->p++);
+        }
+        for (; c <= hi; c++) reSetAdd(set, c);
+    }
+    if (*ps->p != ']') {
+        ps->err = 1;
+        return n;
+    }
+    ps->p++;
+    if (neg)
+        for (int j = 0; j < 8; j++) set[j] = ~set[j];
+    return n;
+}
+
+int reParseAtom(reParser *ps) {
+    int c = (unsigned char)*ps->p++;
+    int n;
+
+    switch (c) {
+        case '(':
+            n = reParseAlt(ps);
+            if (*ps->p != ')') ps->err = 1;
+            else ps->p++;
+            return n;
+        case '[':
+            return reParseClass(ps);
+        case '^':
+            return reNodeNew(ps, RE_BOL, -1, -1);
+        case '$':
+            return reNodeNew(ps, RE_EOL, -1, -1);
+        case '.':
+            n = reSetNew(ps);
+            memset(ps->re->sets[ps->node[n].set], 0xff, sizeof(*ps->re->sets));
+            return n;
+        case '*': case '+': case '?': case ')':
+            ps->err = 1;
+            return reNodeNew(ps, RE_EMPTY, -1, -1);
+    }
+
+    n = reSetNew(ps);
+    uint32_t *set = ps->re->sets[ps->node[n].set];
+    if (c == '\\') {
+        if (!*ps->p) {
+            ps->err = 1;
+            return n;
+        }
+        c = (unsigned char)*ps->p++;
+        if (reSetEscape(set, c)) return n;
+        c = reEscapeChar(c);
+    }
+    reSetAdd(set, c);
+    return n;
+}
+
+int reParseRepeat(reParser *ps) {
+    int n = reParseAtom(ps);
+    while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+        int op = *ps->p++;
+        n = reNodeNew(ps, op == '*' ? RE_STAR : op == '+' ? RE_PLUS : RE_QUEST, n, -1);
+    }
+    return n;
+}
+
+int reParseCat(reParser *ps) {
+    int n = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->err) {
+        int m = reParseRepeat(ps);
+        n = n == -1 ? m : reNodeNew(ps, RE_CAT, n, m);
+    }
+    return n == -1 ? reNodeNew(ps, RE_EMPTY, -1, -1) : n;
+}
+
+int reParseAlt(reParser *ps) {
+    int n = reParseCat(ps);
+    while (*ps->p == '|' && !ps->err) {
+        ps->p++;
+        n = reNodeNew(ps, RE_ALT, n, reParseCat(ps));
+    }
+    return n;
+}
+
+int nfaStateNew(nfa *m, int type, int set, int out, int out1) {
+    m->state = realloc(m->state, sizeof(nfaState) * (m->nstates + 1));
+    m->state[m->nstates].type = type;
+    m->state[m->nstates].set = set;
+    m->state[m->nstates].out = out;
+    m->state[m->nstates].out1 = out1;
+    return m->nstates++;
+}
+
+/* nfaCompile() compiles node so that it continues to state next and returns
+ * its first state. With reverse set it compiles the mirror image pattern:
+ * concatenations run backwards and ^ and $ swap places.
+ */
+int nfaCompile(nfa *m, reNode *node, int n, int next, int reverse) {
+    reNode *nd = &node[n];
+    int s;
+
+    switch (nd->type) {
+        case RE_SET:
+            return nfaStateNew(m, NFA_SET, nd->set, next, -1);
+        case RE_BOL:
+            return nfaStateNew(m, reverse ? NFA_EOL : NFA_BOL, -1, next, -1);
+        case RE_EOL:
+            return nfaStateNew(m, reverse ? NFA_BOL : NFA_EOL, -1, next, -1);
+        case RE_CAT:
+            if (reverse)
+                return nfaCompile(m, node, nd->b, nfaCompile(m, node, nd->a, next, 1), 1);
+            return nfaCompile(m, node, nd->a, nfaCompile(m, node, nd->b, next, 0), 0);
+        case RE_ALT: {
+            int a = nfaCompile(m, node, nd->a, next, reverse);
+            int b = nfaCompile(m, node, nd->b, next, reverse);
+            return nfaStateNew(m, NFA_SPLIT, -1, a, b);
+        }
+        case RE_STAR:
+        {
+            s = nfaStateNew(m, NFA_SPLIT, -1, -1, next);
+            int body = nfaCompile(m, node, nd->a, s, reverse);
+            m->state[s].out = body; //m->state may have moved
+            return s;
+        }
+        case RE_PLUS: {
+            s = nfaStateNew(m, NFA_SPLIT, -1, -1, next);
+            int body = nfaCompile(m, node, nd->a, s, reverse);
+            m->state[s].out = body;
+            return body;
+        }
+        case RE_QUEST: {
+            int a = nfaCompile(m, node, nd->a, next, reverse);
+            return nfaStateNew(m, NFA_SPLIT, -1, a, next);
+        }
+    }
+    return next; //RE_EMPTY
+}
+
+/* reLiteralPrefix() appends the literal bytes every match of node must
+ * start with to re->prefix. Returns 1 if all of node was literal, so the
+ * caller may keep going with what follows it.
+ */
+int reLiteralPrefix(regex *re, reNode *node, int n) {
+    reNode *nd = &node[n];
+
+    if (nd->type == RE_CAT)
+        return reLiteralPrefix(re, node, nd->a) && reLiteralPrefix(re, node, nd->b);
+    if (nd->type == RE_BOL || nd->type == RE_EMPTY) return 1;
+    if (nd->type != RE_SET || re->prefixlen == sizeof(re->prefix)) return 0;
+
+    int c = -1;
+    for (int b = 0; b < 256; b++) {
+        if (!reSetHas(re->sets[nd->set], b)) continue;
+        if (c != -1) return 0;
+        c = b;
+    }
+    re->prefix[re->prefixlen++] = c;
+    return 1;
+}
+
+/* reClasses() splits the 256 byte values into classes that no set in the
+ * pattern tells apart, so DFA states need one transition per class.
+ */
+void reClasses(regex *re) {
+    memset(re->classes, 0, sizeof(re->classes));
+    re->nclasses = 1;
+    for (int s = 0; s < re->nsets; s++) {
+        //split every class by membership in this set
+        int map[256][2];
+        int n = 0;
+        for (int j = 0; j < 256; j++) map[j][0] = map[j][1] = -1;
+        for (int b = 0; b < 256; b++) {
+            int *slot = &map[re->classes[b]][reSetHas(re->sets[s], b)];
+            if (*slot == -1) *slot = n++;
+            re->classes[b] = *slot;
+        }
+        re->nclasses = n;
+    }
+    for (int b = 255; b >= 0; b--) re->rep[re->classes[b]] = b;
+}
+
+void reFree(regex *re) {
+    if (!re) return;
+    free(re->sets);
+    free(re->fwd.state);
+    free(re->rev.state);
+    free(re);
+}
+
+regex *reCompile(const char *pattern) {
+    reParser ps = { pattern, NULL, 0, calloc(1, sizeof(regex)), 0 };
+    regex *re = ps.re;
+
+    int root = reParseAlt(&ps);
+    if (ps.err || *ps.p) {
+        free(ps.node);
+        reFree(re);
+        return NULL;
+    }
+    for (int r = 0; r < 2; r++) {
+        nfa *m = r ? &re->rev : &re->fwd;
+        int match = nfaStateNew(m, NFA_MATCH, -1, -1, -1);
+        m->start = nfaCompile(m, ps.node, root, match, r);
+    }
+    reLiteralPrefix(re, ps.node, root);
+    reClasses(re);
+    free(ps.node);
+    return re;
+}
+
+//A DFA state is the set of NFA states the automaton may be in. States and
+//their transitions are built the first time a scan needs them and cached;
+//the cache is thrown away when it grows past KILO_DFA_MAX_STATES.
+enum dfaFlags {
+    DFA_MATCH = 1,    //a match ends here
+    DFA_MATCH_EOL = 2 //a match ends here if this is the end of the row
+};
+
+typedef struct dfaState {
+    int *set;
+    int n;
+    int flags;
+    int next[]; //per byte class, -1 until computed
+} dfaState;
+
+typedef struct dfa {
+    regex *re;
+    nfa *m;
+    int unanchored; //a new match may start at every position
+    dfaState **state;
+    int nstates;
+    int *table;     //hash of state sets to state index
+    int tablesize;
+    int start[2];   //start state not at / at the start of the text, -1 unknown
+    int *mark;      //per NFA state, == gen if already in the set being built
+    int gen;
+    int *stack;
+    int *buf;       //set being built
+    int nbuf;
+} dfa;
+
+dfa *dfaNew(regex *re, int reverse, int unanchored) {
+    dfa *d = calloc(1, sizeof(dfa));
+    d->re = re;
+    d->m = reverse ? &re->rev : &re->fwd;
+    d->unanchored = unanchored;
+    d->tablesize = KILO_DFA_MAX_STATES * 2;
+    d->table = malloc(sizeof(int) * d->tablesize);
+    memset(d->table, -1, sizeof(int) * d->tablesize);
+    d->start[0] = d->start[1] = -1;
+    d->mark = calloc(d->m->nstates, sizeof(int));
+    d->stack = malloc(sizeof(int) * (d->m->nstates * 2 + 2));
+    //a state's set plus what it reaches once $ holds
+    d->buf = malloc(sizeof(int) * d->m->nstates * 2);
+    return d;
+}
+
+void dfaReset(dfa *d) {
+    for (int j = 0; j < d->nstates; j++) {
+        free(d->state[j]->set);
+        free(d->state[j]);
+    }
+    d->nstates = 0;
+    memset(d->table, -1, sizeof(int) * d->tablesize);
+    d->start[0] = d->start[1] = -1;
+}
+
+void dfaFree(dfa *d) {
+    if (!d) return;
+    dfaReset(d);
+    free(d->state);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+    free(d);
+}
+
+/* dfaClosure() adds s and every state reachable from it without consuming
+ * input to d->buf. Assertions are added but only followed when they hold.
+ */
+void dfaClosure(dfa *d, int s, int atbol, int ateol) {
+    int sp = 0;
+    d->stack[sp++] = s;
+    while (sp > 0) {
+        s = d->stack[--sp];
+        if (d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        d->buf[d->nbuf++] = s;
+
+        nfaState *st = &d->m->state[s];
+        if (st->type == NFA_SPLIT) {
+            d->stack[sp++] = st->out1;
+            d->stack[sp++] = st->out;
+        } else if ((st->type == NFA_BOL && atbol) || (st->type == NFA_EOL && ateol)) {
+            d->stack[sp++] = st->out;
+        }
+    }
+}
+
+int dfaCmpInt(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* dfaIntern() returns the state for the set in d->buf, creating it if new.
+ */
+int dfaIntern(dfa *d) {
+    qsort(d->buf, d->nbuf, sizeof(int), dfaCmpInt);
+
+    uint32_t h = 2166136261u;
+    for (int j = 0; j < d->nbuf; j++) h = (h ^ d->buf[j]) * 16777619u;
+    int slot = h & (d->tablesize - 1);
+    for (; d->table[slot] != -1; slot = (slot + 1) & (d->tablesize - 1)) {
+        dfaState *st = d->state[d->table[slot]];
+        if (st->n == d->nbuf && memcmp(st->set, d->buf, sizeof(int) * d->nbuf) == 0)
+            return d->table[slot];
+    }
+
+    dfaState *st = malloc(sizeof(dfaState) + sizeof(int) * d->re->nclasses);
+    st->n = d->nbuf;
+    st->set = malloc(sizeof(int) * (d->nbuf + 1));
+    memcpy(st->set, d->buf, sizeof(int) * d->nbuf);
+    st->flags = 0;
+    for (int j = 0; j < d->re->nclasses; j++) st->next[j] = -1;
+
+    //matches now, or once $ is allowed to hold
+    d->gen++;
+    int n = d->nbuf;
+    for (int j = 0; j < n; j++) {
+        if (d->m->state[d->buf[j]].type == NFA_MATCH) st->flags |= DFA_MATCH;
+        dfaClosure(d, d->buf[j], 0, 1);
+    }
+    for (int j = n; j < d->nbuf; j++)
+        if (d->m->state[d->buf[j]].type == NFA_MATCH) st->flags |= DFA_MATCH_EOL;
+    st->flags |= (st->flags & DFA_MATCH) ? DFA_MATCH_EOL : 0;
+
+    d->state = realloc(d->state, sizeof(dfaState *) * (d->nstates + 1));
+    d->state[d->nstates] = st;
+    d->table[slot] = d->nstates;
+    return d->nstates++;
+}
+
+int dfaStart(dfa *d, int atbol) {
+    if (d->start[atbol] != -1) return d->start[atbol];
+    if (d->nstates >= KILO_DFA_MAX_STATES) dfaReset(d);
+    d->gen++;
+    d->nbuf = 0;
+    dfaClosure(d, d->m->start, atbol, 0);
+    return d->start[atbol] = dfaIntern(d);
+}
+
+/* dfaStep() returns the state reached from state s on byte c. If the cache
+ * has to be flushed, s is reinterned and *sp updated.
+ */
+int dfaStep(dfa *d, int *sp, int c) {
+    int cls = d->re->classes[c];
+    int next = d->state[*sp]->next[cls];
+    if (next != -1) return next;
+
+    if (d->nstates >= KILO_DFA_MAX_STATES) {
+        dfaState *old = d->state[*sp];
+        int *set = old->set, n = old->n;
+        old->set = NULL;
+        dfaReset(d);
+        memcpy(d->buf, set, sizeof(int) * n);
+        d->nbuf = n;
+        free(set);
+        *sp = dfaIntern(d);
+    }
+
+    d->gen++;
+    d->nbuf = 0;
+    dfaState *st = d->state[*sp];
+    for (int j = 0; j < st->n; j++) {
+        nfaState *ns = &d->m->state[st->set[j]];
+        if (ns->type == NFA_SET && reSetHas(d->re->sets[ns->set], d->re->rep[cls]))
+            dfaClosure(d, ns->out, 0, 0);
+    }
+    if (d->unanchored) dfaClosure(d, d->m->start, 0, 0);
+    next = dfaIntern(d);
+    d->state[*sp]->next[cls] = next;
+    return next;
+}
+
+/* reMatchStarts() runs the reversed pattern backwards over s[stop..len) to
+ * find the positions where a match starts. Returns the smallest such
+ * position between lo and hi (dir > 0) or the largest (dir < 0), or -1.
+ * If count is given, every start position is counted.
+ */
+int reMatchStarts(dfa *rev, const char *s, int len, int stop,
+        int lo, int hi, int dir, long long *count) {
+    int st = dfaStart(rev, 1);
+    int best = -1;
+
+    for (int p = len; p >= stop; p--) {
+        if (p < len) st = dfaStep(rev, &st, (unsigned char)s[p]);
+        int flags = rev->state[st]->flags;
+        if (!(flags & DFA_MATCH) && !(p == 0 && (flags & DFA_MATCH_EOL))) continue;
+        if (count) (*count)++;
+        if (p < lo || p > hi) continue;
+        if (dir > 0 || best == -1) best = p;
+        if (dir < 0 && !count) break;
+    }
+    return best;
+}
+
+/* reMatchEnd() returns the end of the longest match starting at start,
+ * or -1 if there is none.
+ */
+int reMatchEnd(dfa *fwd, const char *s, int len, int start) {
+    int st = dfaStart(fwd, start == 0);
+    int end = -1;
+
+    for (int p = start; ; p++) {
+        dfaState *ds = fwd->state[st];
+        if ((ds->flags & DFA_MATCH) || (p == len && (ds->flags & DFA_MATCH_EOL))) end = p;
+        if (p == len || ds->n == 0) break;
+        st = dfaStep(fwd, &st, (unsigned char)s[p]);
+    }
+    return end;
+}
+
+/*** find ***/
+
+/* editorMemmem() finds needle in haystack. With SSE2 it tests 16 candidate
+ * positions at a time against the needle's first and last byte and only
+ * calls memcmp() where both match, so most of the haystack is skipped at
+ * vector speed.
+ */
+const char *editorMemmem(const char *h, size_t hlen, const char *n, size_t nlen) {
+    if (nlen == 0) return h;
+    if (nlen > hlen) return NULL;
+    if (nlen == 1) return memchr(h, n[0], hlen);
+
+    size_t i = 0, last = hlen - nlen; //last possible start of a match
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(n[0]);
+    __m128i final = _mm_set1_epi8(n[nlen - 1]);
+    for (; i + 15 <= last; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(h + i + bit + 1, n + 1, nlen - 2) == 0) return h + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i <= last; i++)
+        if (h[i] == n[0] && h[i + nlen - 1] == n[nlen - 1] &&
+                memcmp(h + i + 1, n + 1, nlen - 2) == 0)
+            return h + i;
+    return NULL;
+}
+
+//What a search looks for: a literal string, or a compiled regex.
+typedef struct searchQuery {
+    char *text;
+    int len;
+    int regex;
+    regex *re; //NULL if text isn't a valid regex
+} searchQuery;
+
+//A thread's state for running a query: a regex needs DFA caches of its own.
+typedef struct matcher {
+    searchQuery *q;
+    dfa *rev, *fwd;
+    coldCache cold; //frozen rows are read through this
+} matcher;
+
+void editorMatcherInit(matcher *mt, searchQuery *q) {
+    mt->q = q;
+    memset(&mt->cold, 0, sizeof(mt->cold));
+    mt->rev = q->re ? dfaNew(q->re, 1, 1) : NULL;
+    mt->fwd = q->re ? dfaNew(q->re, 0, 0) : NULL;
+}
+
+void editorMatcherFree(matcher *mt) {
+    dfaFree(mt->rev);
+    dfaFree(mt->fwd);
+    mt->rev = mt->fwd = NULL;
+    editorColdCacheFree(&mt->cold);
+}
+
+/* editorRowMatch() returns the column of the first match starting between
+ * lo and hi in direction dir: the smallest for dir 1, the largest for dir
+ * -1, or -1 if none. If count is given, every match in the row is counted.
+ * A row paged out that can't be read back has none, and sets mt->cold.err.
+ */
+int editorRowMatch(matcher *mt, erow *row, int lo, int hi, int dir, long long *count) {
+    searchQuery *q = mt->q;
+    const char *s = editorRowChars(row, &mt->cold);
+    int len = row->size;
+    if (!s) return -1;
+
+    if (hi > len) hi = len;
+    if (!count && lo > hi) return -1;
+
+    if (q->re) {
+        int stop = count ? 0 : lo;
+        if (q->re->prefixlen) {
+            //matches can only start where the literal prefix does
+            const char *p = editorMemmem(s + stop, len - stop,
+                    q->re->prefix, q->re->prefixlen);
+            if (!p) return -1;
+            stop = p - s;
+        }
+        return reMatchStarts(mt->rev, s, len, stop, lo, hi, dir, count);
+    }
+
+    if (count) {
+        int best = -1;
+        for (const char *p = s; (p = editorMemmem(p, s + len - p, q->text, q->len)); p++) {
+            int pos = p - s;
+            (*count)++;
+            if (pos < lo || pos > hi || (dir > 0 && best != -1)) continue;
+            best = pos;
+        }
+        return best;
+    }
+    if (dir > 0) {
+        const char *p = editorMemmem(s + lo, len - lo, q->text, q->len);
+        return p && p - s <= hi ? p - s : -1;
+    }
+    if (hi > len - q->len) hi = len - q->len;
+    for (int j = hi; j >= lo; j--)
+        if (s[j] == q->text[0] && memcmp(s + j, q->text, q->len) == 0)
+            return j;
+    return -1;
+}
+
+/* editorMatchLen() returns the length of the match starting at `at`; for a
+ * regex that is the longest one.
+ */
+int editorMatchLen(matcher *mt, erow *row, int at) {
+    if (!mt->q->re) return mt->q->len;
+    const char *s = editorRowChars(row, &mt->cold);
+    return s ? reMatchEnd(mt->fwd, s, row->size, at) - at : 0;
+}
+
+/* editorFindFrom() searches the buffer starting at row, col in direction
+ * dir, wrapping around at either end. Returns the matching row and sets
+ * *mcol, or returns -1.
+ */
+int editorFindFrom(int row, int col, int dir, matcher *mt, int *mcol) {
+    int r = row, c = col;
+
+    for (int n = 0; n <= E.numrows; n++) {
+        int m = editorRowMatch(mt, &E.row[r], dir > 0 ? c : 0, dir > 0 ? INT_MAX : c, dir, NULL);
+        //the last round is back on the first row, for the part not yet searched
+        if (m != -1 && n == E.numrows && (dir > 0 ? m >= col : m <= col)) m = -1;
+        if (m != -1) {
+            *mcol = m;
+            return r;
+        }
+        r += dir;
+        if (r == E.numrows) r = 0;
+        else if (r == -1) r = E.numrows - 1;
+        c = dir > 0 ? 0 : INT_MAX;
+    }
+    return -1;
+}
+
+/* editorFindIndexed() is editorFindFrom() over only the rows the trigram
+ * index says may match: a regex needs a literal prefix of three bytes or
+ * more for that. Returns -2 if the index can't be used.
+ */
+int editorFindIndexed(int row, int col, int dir, matcher *mt, int *mcol) {
+    searchQuery *q = mt->q;
+    int n = q->re ? editorIndexLookup(q->re->prefix, q->re->prefixlen)
+                  : editorIndexLookup(q->text, q->len);
+    if (n < 0) return -2;
+    if (n == 0) return -1;
+
+    //the first candidate at or after row, or at or before it scanning back
+    int *cand = E.index->cand;
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cand[mid] < row + (dir < 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    int first = dir > 0 ? lo % n : (lo - 1 + n) % n;
+
+    for (int i = 0; i <= n; i++) {
+        int r = cand[((first + i * dir) % n + n) % n];
+        int from = 0, to = INT_MAX;
+        if (r == row && i == 0) {
+            if (dir > 0) from = col;
+            else to = col;
+        } else if (r == row && i == n) {
+            //back on the first row, for the part not yet searched
+            if (dir > 0) to = col - 1;
+            else from = col + 1;
+        } else if (i == n) {
+            break;
+        }
+        int m = editorRowMatch(mt, &E.row[r], from, to, dir, NULL);
+        if (m != -1) {
+            *mcol = m;
+            return r;
+        }
+    }
+    return -1;
+}
+
+//Searches over large buffers are split into chunks of KILO_SEARCH_CHUNK rows,
+//numbered in the order the scan visits them starting at the cursor, and
+//handed out to a pool of worker threads. While waiting for keys the main
+//thread takes results in chunk order, so the first match after the cursor is
+//shown as soon as the chunks before it are done, while the rest keep counting
+//in the background.
+typedef struct searchChunk {
+    int done;
+    int row, col;      //first match in scan order, row -1 if none
+    long long count;
+} searchChunk;
+
+typedef struct searchJob {
+    unsigned id;
+    searchQuery *q;    //E.find.query, which outlives the job
+    int row, col, dir; //where the scan starts
+    int numrows;
+    int nchunks;
+    int next;          //next chunk to hand out
+    int cancel;
+    int workers;       //workers currently on this job, guarded by pool lock
+    int ndone;         //chunks done, guarded by lock
+    long long count;   //matches counted so far, guarded by lock
+    int err;           //rows a worker couldn't read, guarded by lock
+    int shown;         //chunks checked for the first match, see editorFindPoll()
+    int reported;      //chunks done when the count was last shown
+    searchChunk *chunk;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //a chunk finished
+} searchJob;
+
+typedef struct searchPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //a job was posted, or a worker left one
+    searchJob *job;
+    unsigned nextid;
+    int nthreads;
+} searchPool;
+
+searchPool *editorSearchPool;
+
+/* editorSearchChunk() scans one chunk, counting every match in it and
+ * remembering the first one in scan order. Scan position t runs from 0
+ * to numrows: t == 0 is the start row from the start column on, and
+ * t == numrows is the start row again, for the part before the start column.
+ */
+void editorSearchChunk(searchJob *job, matcher *mt, searchChunk *ch, int i) {
+    int n = job->numrows;
+    int t1 = (i + 1) * KILO_SEARCH_CHUNK;
+    if (t1 > n + 1) t1 = n + 1;
+
+    ch->row = -1;
+    ch->count = 0;
+    for (int t = i * KILO_SEARCH_CHUNK; t < t1; t++) {
+        if ((t & 1023) == 0 && __atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+            return;
+        int r = job->dir > 0 ? (job->row + t) % n : ((job->row - t) % n + n) % n;
+        int lo = 0, hi = INT_MAX;
+        if (t == 0) {
+            if (job->dir > 0) lo = job->col;
+            else hi = job->col;
+        } else if (t == n) {
+            if (job->dir > 0) hi = job->col - 1;
+            else lo = job->col + 1;
+        }
+        if (ch->row != -1) hi = -1; //only counting from here on
+        long long *count = t < n ? &ch->count : NULL;
+        if (!count && lo > hi) continue;
+
+        int best = editorRowMatch(mt, &E.row[r], lo, hi, job->dir, count);
+        if (best != -1) {
+            ch->row = r;
+            ch->col = best;
+        }
+    }
+}
+
+void *editorSearchThread(void *arg) {
+    searchPool *pool = arg;
+    unsigned last = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->job || pool->job->id == last)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        searchJob *job = pool->job;
+        last = job->id;
+        job->workers++;
+        pthread_mutex_unlock(&pool->lock);
+
+        matcher mt;
+        editorMatcherInit(&mt, job->q);
+        int i;
+        while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+            searchChunk ch;
+            editorSearchChunk(job, &mt, &ch, i);
+            if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) break;
+
+            pthread_mutex_lock(&job->lock);
+            job->chunk[i] = ch;
+            job->chunk[i].done = 1;
+            job->count += ch.count;
+            job->ndone++;
+            if (mt.cold.err) job->err = mt.cold.err;
+            pthread_cond_broadcast(&job->cond);
+            pthread_mutex_unlock(&job->lock);
+        }
+        editorMatcherFree(&mt);
+
+        pthread_mutex_lock(&pool->lock);
+        job->workers--;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    return NULL;
+}
+
+//Whether search threads are reading E.row, which must not change meanwhile.
+int editorSearchRunning(void) {
+    return editorSearchPool && editorSearchPool->job;
+}
+
+/* editorSearchCancel() stops the running search and waits for the workers
+ * to let go of it, after which the buffer may be modified again.
+ */
+void editorSearchCancel(void) {
+    searchPool *pool = editorSearchPool;
+    if (!pool || !pool->job) return;
+
+    searchJob *job = pool->job;
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->lock);
+    pool->job = NULL;
+    while (job->workers > 0) pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    free(job->chunk);
+    free(job);
+}
+
+searchPool *editorSearchPoolGet(void) {
+    if (editorSearchPool) return editorSearchPool;
+
+    searchPool *pool = calloc(1, sizeof(searchPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > KILO_SEARCH_MAX_THREADS) n = KILO_SEARCH_MAX_THREADS;
+    for (long j = 0; j < n; j++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, editorSearchThread, pool) != 0) break;
+        pthread_detach(thread);
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0) {
+        free(pool);
+        return NULL;
+    }
+    editorSearchPool = pool;
+    return pool;
+}
+
+/* editorFindParallel() is editorFindFrom() for big buffers. It posts a job
+ * to the pool and returns without waiting, so the next key can cancel it;
+ * editorFindPoll() moves to the first match once the chunks up to it are
+ * in, and reports the count. Returns 0, or -2 if the pool can't be used.
+ */
+int editorFindParallel(int row, int col, int dir, searchQuery *q) {
+    searchPool *pool = editorSearchPoolGet();
+    if (!pool) return -2;
+
+    searchJob *job = calloc(1, sizeof(searchJob));
+    job->q = q;
+    job->row = row;
+    job->col = col;
+    job->dir = dir;
+    job->numrows = E.numrows;
+    job->nchunks = E.numrows / KILO_SEARCH_CHUNK + 1;
+    job->chunk = calloc(job->nchunks, sizeof(searchChunk));
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    job->id = ++pool->nextid;
+    pool->job = job;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* editorFindShow() makes the match at row, col the current one and moves
+ * the cursor to it.
+ */
+void editorFindShow(int row, int col) {
+    E.find.row = row;
+    E.find.col = col;
+    E.find.len = editorMatchLen(E.find.match, &E.row[row], col);
+    E.find.found = 1;
+    E.cy = row;
+    E.cx = col;
+}
+
+/* editorFindPoll() is called while waiting for input. As more chunks of a
+ * parallel search come in it moves to the first match, once the chunks
+ * before it are done, and shows the match count. Returns 1 if the screen
+ * changed.
+ */
+int editorFindPoll(void) {
+    searchPool *pool = editorSearchPool;
+    if (!pool || !pool->job) return 0;
+
+    searchJob *job = pool->job;
+    int moved = 0;
+    pthread_mutex_lock(&job->lock);
+    for (; job->shown < job->nchunks && job->chunk[job->shown].done; job->shown++) {
+        searchChunk *ch = &job->chunk[job->shown];
+        if (ch->row != -1) {
+            editorFindShow(ch->row, ch->col);
+            job->shown = job->nchunks;
+            moved = 1;
+            break;
+        }
+    }
+    long long count = job->count;
+    int ndone = job->ndone;
+    int err = job->err;
+    pthread_mutex_unlock(&job->lock);
+
+    if (ndone == job->reported) return moved;
+    job->reported = ndone;
+    editorSetStatusMessage("%s: %s (%lld matches%s%s%s)",
+            job->q->regex ? "Regex" : "Search", job->q->text, count,
+            ndone == job->nchunks ? "" : " so far",
+            err ? ", some rows unreadable: " : "", err ? strerror(err) : "");
+    return 1;
+}
+
+/* editorFindWait() waits until a parallel search has its first match, or
+ * has found none, and moves there: a search accepted with Enter lands
+ * where the synchronous one would have.
+ */
+void editorFindWait(void) {
+    searchPool *pool = editorSearchPool;
+    if (!pool || !pool->job) return;
+
+    searchJob *job = pool->job;
+    pthread_mutex_lock(&job->lock);
+    for (int i = job->shown; i < job->nchunks; i++) {
+        while (!job->chunk[i].done) pthread_cond_wait(&job->cond, &job->lock);
+        if (job->chunk[i].row != -1) break;
+    }
+    pthread_mutex_unlock(&job->lock);
+    editorFindPoll();
+}
+
+void editorFindClearQuery(void) {
+    if (!E.find.query) return;
+    editorMatcherFree(E.find.match);
+    free(E.find.match);
+    reFree(E.find.query->re);
+    free(E.find.query->text);
+    free(E.find.query);
+    E.find.query = NULL;
+    E.find.match = NULL;
+}
+
+/* editorFindSetQuery() makes query the current search, compiling it as a
+ * regex in regex mode. Returns 0 if it is not a valid regex.
+ */
+int editorFindSetQuery(const char *query) {
+    searchQuery *q = E.find.query;
+    if (q && q->regex == E.find.regex && strcmp(q->text, query) == 0)
+        return q->re || !q->regex;
+
+    editorFindClearQuery();
+    q = calloc(1, sizeof(searchQuery));
+    q->len = strlen(query);
+    q->text = malloc(q->len + 1);
+    memcpy(q->text, query, q->len + 1);
+    q->regex = E.find.regex;
+    if (q->regex) q->re = reCompile(query);
+    E.find.query = q;
+    E.find.match = malloc(sizeof(matcher));
+    editorMatcherInit(E.find.match, q);
+    return q->re || !q->regex;
+}
+
+void editorFindPrompt(void) {
+    snprintf(E.find.prompt, sizeof(E.find.prompt),
+            "%s: %%s (ESC to cancel, arrows for next/prev, ^T %s)",
+            E.find.regex ? "Regex" : "Search", E.find.regex ? "literal" : "regex");
+}
+
+/* editorFindCallback() runs on every key typed at the search prompt.
+ * A literal query that grows can only match at or after the current match,
+ * so the scan resumes there; any other change restarts from where the
+ * search began.
+ */
+void editorFindCallback(char *query, int key) {
+    int qlen = strlen(query);
+    int row, col, dir = 1;
+
+    //whatever the key, a search still running for the last one is stale,
+    //once Enter has taken its first match
+    if (key == '\r') editorFindWait();
+    editorSearchCancel();
+
+    if (key == '\r' || key == '\x1b') {
+        E.find.found = 0;
+        editorFindClearQuery();
+        return;
+    } else if (key == CTRL_KEY('t')) {
+        E.find.regex = !E.find.regex;
+        E.find.found = 0;
+        editorFindPrompt();
+    }
+
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        if (!E.find.found) return;
+        row = E.find.row;
+        col = E.find.col + 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        if (!E.find.found) return;
+        row = E.find.row;
+        col = E.find.col - 1;
+        dir = -1;
+    } else if (E.find.found && !E.find.regex && qlen > E.find.len) {
+        row = E.find.row;
+        col = E.find.col;
+    } else {
+        row = E.find.origrow;
+        col = E.find.origcol;
+    }
+
+    E.find.found = 0;
+    if (qlen == 0 || E.numrows == 0 || !editorFindSetQuery(query)) return;
+    if (row >= E.numrows) row = 0;
+
+    //keep the position so the next query still resumes sensibly, should
+    //there be no match or one still being looked for
+    E.find.row = row;
+    E.find.col = col;
+
+    int mcol;
+    int mrow = editorFindIndexed(row, col, dir, E.find.match, &mcol);
+    if (mrow == -2 && E.numrows >= KILO_SEARCH_PAR_ROWS &&
+            editorFindParallel(row, col, dir, E.find.query) == 0)
+        return;
+    if (mrow == -2)
+        mrow = editorFindFrom(row, col, dir, E.find.match, &mcol);
+    if (mrow != -1) editorFindShow(mrow, mcol);
+}
+
+void editorFind(void) {
+    int cx = E.cx, cy = E.cy;
+    int coloff = E.coloff, rowoff = E.rowoff;
+
+    E.find.origrow = E.find.row = cy;
+    E.find.origcol = E.find.col = cx;
+    E.find.found = 0;
+
+    editorFindPrompt();
+    char *query = editorPrompt(E.find.prompt, editorFindCallback);
+    if (query) {
+        free(query);
+    } else {
+        E.cx = cx;
+        E.cy = cy;
+        E.coloff = coloff;
+        E.rowoff = rowoff;
+    }
+}
+
+//A replace-all is one undo entry and one journal record, holding the
+//replacement, the text replaced and, for every row it changed, each match:
+//    int replen, replen bytes; int oldlen, oldlen bytes;
+//    then per row: int row, int n; then per match: int col
+//For a regex the matches differ, so oldlen is -1 and each match is
+//    int col, int len, len bytes
+//Columns are in the row before the replace.
+typedef struct replaceBuf {
+    char *b;
+    int len, cap;
+} replaceBuf;
+
+void editorReplaceBufAppend(replaceBuf *rb, const void *s, int len) {
+    if (rb->len + len > rb->cap) {
+        rb->cap = (rb->len + len) * 2;
+        rb->b = realloc(rb->b, rb->cap);
+    }
+    memcpy(rb->b + rb->len, s, len);
+    rb->len += len;
+}
+
+typedef struct replaceHdr {
+    const char *rep, *old;
+    int replen, oldlen;
+    const char *rows; //first row record
+} replaceHdr;
+
+void editorReplaceHdr(replaceHdr *h, const char *p) {
+    memcpy(&h->replen, p, sizeof(int));
+    h->rep = p + sizeof(int);
+    memcpy(&h->oldlen, h->rep + h->replen, sizeof(int));
+    h->old = h->rep + h->replen + sizeof(int);
+    h->rows = h->old + (h->oldlen > 0 ? h->oldlen : 0);
+}
+
+/* editorReplaceMatch() reads the match at p into *col, *mlen and *old and
+ * returns the record after it.
+ */
+const char *editorReplaceMatch(replaceHdr *h, const char *p, int *col, int *mlen, const char **old) {
+    memcpy(col, p, sizeof(int));
+    p += sizeof(int);
+    if (h->oldlen >= 0) {
+        *mlen = h->oldlen;
+        *old = h->old;
+        return p;
+    }
+    memcpy(mlen, p, sizeof(int));
+    *old = p + sizeof(int);
+    return *old + *mlen;
+}
+
+/* editorReplaceCheck() tells whether a replace-all read back from the
+ * journal fits the rows it names, undone first if inverse is set.
+ */
+int editorReplaceCheck(const char *p, int len, int inverse) {
+    const char *end = p + len;
+    replaceHdr h;
+    if (len < (int)(2 * sizeof(int))) return 0;
+    editorReplaceHdr(&h, p);
+    if (h.replen < 0 || h.rows > end) return 0;
+
+    for (p = h.rows; p < end; ) {
+        int at, n, col, mlen, last = 0;
+        const char *old;
+        if (end - p < (long)(2 * sizeof(int))) return 0;
+        memcpy(&at, p, sizeof(int));
+        memcpy(&n, p + sizeof(int), sizeof(int));
+        p += 2 * sizeof(int);
+        if (at < 0 || at >= E.numrows || n <= 0) return 0;
+
+        int size = E.row[at].size, shift = 0;
+        for (int j = 0; j < n; j++) {
+            if (end - p < (long)sizeof(int)) return 0;
+            p = editorReplaceMatch(&h, p, &col, &mlen, &old);
+            if (p > end || mlen < 0 || col < last) return 0;
+            last = col + mlen;
+            shift += h.replen - mlen;
+        }
+        if (last + (inverse ? shift : 0) > size) return 0;
+    }
+    return 1;
+}
+
+/* editorReplaceApply() carries out a replace-all recorded as above, or
+ * undoes it if inverse is set. Each row is rebuilt once, at its exact size.
+ */
+void editorReplaceApply(const char *p, int len, int inverse) {
+    const char *end = p + len;
+    replaceHdr h;
+    editorReplaceHdr(&h, p);
+    editorJournalAppend(JRN_REPLACE, 0, inverse, p, len);
+    long long t0 = editorTraceBegin();
+    int rows = 0;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+    for (p = h.rows; p < end; ) {
+        int at, n, col, mlen;
+        const char *old;
+        memcpy(&at, p, sizeof(int));
+        memcpy(&n, p + sizeof(int), sizeof(int));
+        p += 2 * sizeof(int);
+        erow *row = &E.row[at];
+        editorRowThaw(row);
 
-    E.numrows++;
-}
+        int size = row->size;
+        const char *m = p;
+        for (int j = 0; j < n; j++) {
+            m = editorReplaceMatch(&h, m, &col, &mlen, &old);
+            size += inverse ? mlen - h.replen : h.replen - mlen;
+        }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
+        const char *text = editorRowChars(row, &E.coldcache);
+        char *chars = malloc(size + 1);
+        int src = 0, dst = 0, shift = 0;
+        for (int j = 0; j < n; j++) {
+            p = editorReplaceMatch(&h, p, &col, &mlen, &old);
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
+            //in the row as it is now, the match sits at from and is cur long
+            int from = inverse ? col + shift : col;
+            int cur = inverse ? h.replen : mlen;
+            memcpy(chars + dst, text + src, from - src);
+            dst += from - src;
+            memcpy(chars + dst, inverse ? old : h.rep, inverse ? mlen : h.replen);
+            dst += inverse ? mlen : h.replen;
+            src = from + cur;
+            shift += h.replen - mlen;
+        }
+        memcpy(chars + dst, text + src, row->size - src);
+        chars[size] = '\0';
+        editorRowSetChars(row, chars, size);
+        rows++;
+    }
+    E.dirty++;
+    editorTraceEnd("editorUpdateRow: replace", t0, rows);
 }
 
-/*** editor operations ***/
+/* editorReplaceRow() appends row's matches of the current query to rb, in
+ * the format above. Returns how many there were.
+ */
+int editorReplaceRow(replaceBuf *rb, int at) {
+    erow *row = &E.row[at];
+    int n = 0, head = rb->len;
+    int literal = !E.find.query->re;
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorAppendRow("", 0);
+    for (int pos = 0; pos <= row->size; ) {
+        int m = editorRowMatch(E.find.match, row, pos, INT_MAX, 1, NULL);
+        if (m == -1) break;
+        int mlen = editorMatchLen(E.find.match, row, m);
+        if (mlen == 0) {
+            //an empty regex match has nothing to replace
+            pos = m + 1;
+            continue;
+        }
+        if (n++ == 0) {
+            editorReplaceBufAppend(rb, &at, sizeof(int));
+            editorReplaceBufAppend(rb, &n, sizeof(int));
+        }
+        editorReplaceBufAppend(rb, &m, sizeof(int));
+        if (!literal) {
+            editorReplaceBufAppend(rb, &mlen, sizeof(int));
+            editorReplaceBufAppend(rb, editorRowChars(row, &E.find.match->cold) + m, mlen);
+        }
+        pos = m + mlen;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    if (n) memcpy(rb->b + head + sizeof(int), &n, sizeof(int));
+    return n;
 }
 
-/*** file i/o ***/
+void editorReplacePrompt(void) {
+    snprintf(E.find.prompt, sizeof(E.find.prompt), "%s: %%s (ESC to cancel, ^T %s)",
+            E.find.regex ? "Replace regex" : "Replace", E.find.regex ? "literal" : "regex");
+}
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+void editorReplaceCallback(char *query, int key) {
+    (void)query;
+    if (key == CTRL_KEY('t')) {
+        E.find.regex = !E.find.regex;
+        editorReplacePrompt();
+    }
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+/* editorReplaceAll() finds every match first, then rewrites the rows that
+ * have any in one pass, recorded as a single undo entry. One too big for
+ * the undo budget is only carried out if the user agrees to lose the undo
+ * history, which can't be stepped back through past it.
+ */
+void editorReplaceAll(void) {
+    editorReplacePrompt();
+    char *query = editorPrompt(E.find.prompt, editorReplaceCallback);
+    if (!query) return;
+    char *with = editorPrompt("With: %s (ESC to cancel)", NULL);
+    if (!with) {
+        free(query);
+        return;
+    }
+    if (!editorFindSetQuery(query)) {
+        editorSetStatusMessage("Bad regex: %s", query);
+        free(query);
+        free(with);
+        editorFindClearQuery();
+        return;
+    }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+    replaceBuf rb = {NULL, 0, 0};
+    searchQuery *q = E.find.query;
+    int replen = strlen(with), oldlen = q->re ? -1 : q->len;
+    editorReplaceBufAppend(&rb, &replen, sizeof(int));
+    editorReplaceBufAppend(&rb, with, replen);
+    editorReplaceBufAppend(&rb, &oldlen, sizeof(int));
+    if (!q->re) editorReplaceBufAppend(&rb, q->text, q->len);
 
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    
-        //strip off \r\n at end of line
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
+    long long count = 0;
+    int rows = 0, first = -1;
+    int ncand = q->re ? editorIndexLookup(q->re->prefix, q->re->prefixlen)
+                      : editorIndexLookup(q->text, q->len);
+    int n = ncand >= 0 ? ncand : E.numrows;
+    E.find.match->cold.err = 0;
+    for (int j = 0; j < n; j++) {
+        int at = ncand >= 0 ? E.index->cand[j] : j;
+        int m = editorReplaceRow(&rb, at);
+        if (m == 0) continue;
+        if (first == -1) first = at;
+        count += m;
+        rows++;
+    }
+    if (E.find.match->cold.err) {
+        //a replace-all that skips rows it couldn't read isn't one
+        editorSetStatusMessage("Can't replace, rows can't be read back: %s",
+                strerror(E.find.match->cold.err));
+        free(rb.b);
+        free(query);
+        free(with);
+        editorFindClearQuery();
+        return;
+    }
 
-        editorAppendRow(line,linelen);
+    int undoable = (long long)sizeof(undoHdr) + rb.len <= E.undo.budget;
+    if (count && !undoable) {
+        char prompt[96];
+        snprintf(prompt, sizeof(prompt), "%lld replacements are too big to undo, "
+                "go ahead and clear undo history? (y/n) %%s", count);
+        char *yes = editorPrompt(prompt, NULL);
+        int ok = yes && (yes[0] == 'y' || yes[0] == 'Y');
+        free(yes);
+        if (!ok) {
+            editorSetStatusMessage("Replace cancelled");
+            free(rb.b);
+            free(query);
+            free(with);
+            editorFindClearQuery();
+            return;
+        }
+        E.undo.len = E.undo.cur = 0;
+        E.undo.last = -1;
     }
-    free(line);
-    fclose(fp);
+    if (count) {
+        if (undoable) editorUndoRecord(UNDO_REPLACE, first, 0, rb.b, rb.len);
+        editorReplaceApply(rb.b, rb.len, 0);
+        if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    }
+    editorSetStatusMessage("Replaced %lld occurrence%s in %d line%s%s", count,
+            count == 1 ? "" : "s", rows, rows == 1 ? "" : "s",
+            undoable ? "" : " (too big to undo)");
+    free(rb.b);
+    free(query);
+    free(with);
+    editorFindClearQuery();
 }
 
 /*** append buffer ***/
@@ -336,6 +5027,8 @@ struct abuf {
 
 void abAppend(struct abuf *ab, const char *s, int len) {
     char *new = realloc(ab->b, ab->len + len);
+    editorPerfAlloc();
+    if (new) __atomic_add_fetch(&E.mem[MEM_OUTPUT], len, __ATOMIC_RELAXED);
 
     if (new == NULL) return;
     memcpy(&new[ab->len], s, len);
@@ -344,11 +5037,27 @@ void abAppend(struct abuf *ab, const char *s, int len) {
 }
 
 void abFree(struct abuf *ab) {
+    __atomic_sub_fetch(&E.mem[MEM_OUTPUT], ab->len, __ATOMIC_RELAXED);
     free(ab->b);
 }
 
 /*** output ***/
 
+//Frames pass to the render thread through two slots: the thread writes one
+//while the main thread captures the next into the other, overwriting it if
+//the thread hasn't picked it up yet. Only the newest frame matters.
+typedef struct renderer {
+    pthread_t thread;
+    pthread_mutex_t lock; //guards everything below, never held while writing
+    pthread_cond_t cond;  //a frame is pending, or stop was set
+    frame slot[2];
+    int pending;          //slot with a frame to write, or -1
+    int busy;             //slot being written, or -1
+    unsigned version;     //of the last frame captured
+    unsigned shown;       //of the last frame written
+    int stop;
+} renderer;
+
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) 
@@ -368,22 +5077,53 @@ void editorScroll() {
     }
 }
 
+//The attributes the terminal draws text with as a frame is written, so SGR
+//sequences are only sent where they change, even across rows.
+struct termAttr {
+    int color;   //foreground color, -1 for the default
+    int inverse;
+};
+
+/* editorSetAttr() switches the terminal to color and inverse, with one SGR
+ * sequence covering whatever differs from attr.
+ */
+void editorSetAttr(struct abuf *ab, struct termAttr *attr, int color, int inverse) {
+    if (attr->color == color && attr->inverse == inverse) return;
+
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "\x1b[");
+    if (color == -1 && !inverse)
+        ; //a bare reset is shortest
+    else if (attr->inverse != inverse)
+        len += snprintf(buf + len, sizeof(buf) - len, "%s", inverse ? "7" : "27");
+    if (attr->color != color && (color != -1 || inverse))
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%d",
+                attr->inverse != inverse ? ";" : "", color == -1 ? 39 : color);
+    buf[len++] = 'm';
+    abAppend(ab, buf, len);
+    attr->color = color;
+    attr->inverse = inverse;
+}
+
 /* editorDrawRows() inserts '~' along the left column as in vi
  */
-void editorDrawRows(struct abuf *ab) {
-    for (int y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
+void editorDrawRows(struct abuf *ab, frame *f) {
+    struct termAttr attr = {-1, 0};
 
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows /3) {
+    for (int y = 0; y < f->screenrows; y++) {
+        int skipclear = 0;
+
+        if (f->len[y] < 0) {
+            editorSetAttr(ab, &attr, -1, 0);
+            if (f->numrows == 0 && y == f->screenrows /3) {
                 //Draw welcome message
                 char welcome[80];
                 int welcomeLen = snprintf(welcome, sizeof(welcome), "Kilo Editor -- version %s", KILO_VERSION);
                 //Ensure not to go past end of terminal window
-                if (welcomeLen > E.screencols) welcomeLen = E.screencols;
+                if (welcomeLen > f->screencols) welcomeLen = f->screencols;
 
                 //Centre welcome message
-                int padding = (E.screencols - welcomeLen) /2;
+                int padding = (f->screencols - welcomeLen) /2;
                 if (padding) {
                     abAppend(ab, "~", 1);
                     padding--;
@@ -395,63 +5135,179 @@ void editorDrawRows(struct abuf *ab) {
                 abAppend(ab, "~", 1);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            int len = f->len[y];
+            int ms = f->ms[y], me = f->me[y];
+            char *c = &f->text[y * f->screencols];
+            unsigned char *hl = &f->hl[y * f->screencols];
+            int j = 0;
+            while (j < len) {
+                //runs never cross either end of the match
+                int end = j < ms ? ms : j < me ? me : len;
+                int inverse = j >= ms && j < me;
+
+                //blanks look the same in any color, unless inverse makes it the background
+                int blank = !inverse;
+                int run = j;
+                while (blank && run < end && c[run] == ' ') run++;
+                if (run == j) {
+                    int h = hl[j];
+                    while (run < end && ((blank && c[run] == ' ') || hl[run] == h)) run++;
+                    editorSetAttr(ab, &attr, h == HL_NORMAL ? -1 : editorSyntaxToColor(h), inverse);
+                } else {
+                    editorSetAttr(ab, &attr, attr.color, inverse);
+                }
+                abAppend(ab, &c[j], run - j);
+                j = run;
+            }
+            //the color carries over to the next row, inverse would fill the cleared line
+            editorSetAttr(ab, &attr, attr.color, 0);
+            if (len == f->screencols) skipclear = 1;
         }
 
-        abAppend(ab, "\x1b[K", 3); //K commands clears a line, default arg=0, clear line to right of cursor.
+        //K clears the rest of the line, not needed when the row filled it
+        if (!skipclear) abAppend(ab, "\x1b[K", 3);
         abAppend(ab, "\r\n", 2);
     }
+    editorSetAttr(ab, &attr, -1, 0);
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
+void editorDrawStatusBar(struct abuf *ab, frame *f) {
     abAppend(ab, "\x1b[7m", 4); //<esc>[7m switches terminal to inverted colours
+    abAppend(ab, f->status, f->screencols);
+    abAppend(ab, "\x1b[m", 3);//<esc>[m switches back to normal formatting
+    abAppend(ab, "\r\n", 2);
+}
+
+void editorDrawMessageBar(struct abuf *ab, frame *f) {
+    abAppend(ab, "\x1b[K", 3); //clear the line
+    abAppend(ab, f->msg, f->msglen);
+}
 
-    char status[80], rstatus[80];
+/* editorCaptureStatusBar() lays out the status bar, screencols wide.
+ */
+void editorCaptureStatusBar(frame *f) {
+    char status[256], rstatus[80];
 
-    //print file name and number of lines
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines",
-            E.filename ? E.filename : "[No File]", E.numrows);
+    //print file name, number of lines and whether there are unsaved edits,
+    //or an overlay in their place
+    int len;
+    if (E.perf.overlay == PERF_OVERLAY)
+        len = editorPerfStatus(status, sizeof(status));
+    else if (E.perf.overlay == MEM_OVERLAY)
+        len = editorMemStatus(status, sizeof(status));
+    else if (E.perf.overlay == ROWS_OVERLAY)
+        len = editorRowStatus(status, sizeof(status));
+    else
+        len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                E.filename ? E.filename : "[No File]", E.numrows,
+                E.dirty ? "(modified)" : "");
     //print current line/total lines (right side)
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", 
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+            E.syntax ? E.syntax->filetype : "no ft",
             E.cy + 1, E.numrows); //current line is in cy
 
-    if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
+    if (len > f->screencols) len = f->screencols;
+    memcpy(f->status, status, len);
 
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+    while (len < f->screencols) {
+        if (f->screencols - len == rlen) {
+            memcpy(&f->status[len], rstatus, rlen);
             break;
         } else {
-            abAppend(ab, " ", 1);
-            len++;
+            f->status[len++] = ' ';
         }
     }
-    abAppend(ab, "\x1b[m", 3);//<esc>[m switches back to normal formatting
-    abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3); //clear the line
+//What the buffers of a frame of rows by cols take.
+long long editorFrameBytes(int rows, int cols) {
+    return (long long)rows * (3 * sizeof(int) + 2 * cols) + cols;
+}
+
+/* editorCapture() copies what the screen should show into f: the visible
+ * part of every row on screen with its highlight, the bars and the cursor.
+ * It costs a screenful of bytes whatever the size of the file.
+ */
+void editorCapture(frame *f) {
+    if (f->screenrows != E.screenrows || f->screencols != E.screencols) {
+        __atomic_add_fetch(&E.mem[MEM_OUTPUT],
+                editorFrameBytes(E.screenrows, E.screencols) -
+                editorFrameBytes(f->screenrows, f->screencols), __ATOMIC_RELAXED);
+        f->screenrows = E.screenrows;
+        f->screencols = E.screencols;
+        f->len = realloc(f->len, sizeof(int) * f->screenrows);
+        f->ms = realloc(f->ms, sizeof(int) * f->screenrows);
+        f->me = realloc(f->me, sizeof(int) * f->screenrows);
+        f->text = realloc(f->text, f->screenrows * f->screencols);
+        f->hl = realloc(f->hl, f->screenrows * f->screencols);
+        f->status = realloc(f->status, f->screencols);
+    }
+    f->numrows = E.numrows;
+
+    for (int y = 0; y < f->screenrows; y++) {
+        int filerow = y + E.rowoff;
+        if (filerow >= E.numrows) {
+            f->len[y] = -1;
+            continue;
+        }
+
+        erow *row = &E.row[filerow];
+        //rendered rows are dropped to save memory, frozen ones lose hl too
+        const char *render = editorRowRendered(row);
+        if (!row->hl && row->cold && row->hlstart != HL_STATE_UNKNOWN)
+            editorHighlightRow(row, row->hlstart);
+        int len = row->rsize - E.coloff;
+        if (len < 0) len = 0;
+        if (len > f->screencols) len = f->screencols;
+        f->len[y] = len;
+        memcpy(&f->text[y * f->screencols], &render[E.coloff], len);
+        //rows the background highlighter hasn't delivered are drawn plain
+        if (row->hl)
+            memcpy(&f->hl[y * f->screencols], &row->hl[E.coloff], len);
+        else
+            memset(&f->hl[y * f->screencols], HL_NORMAL, len);
+
+        //the search match is overlaid in inverse video, clipped to the screen
+        int ms = 0, me = 0;
+        if (E.find.found && filerow == E.find.row) {
+            ms = editorRowCxToRx(row, E.find.col) - E.coloff;
+            me = editorRowCxToRx(row, E.find.col + E.find.len) - E.coloff;
+            if (ms < 0) ms = 0;
+            if (me > len) me = len;
+            if (ms > me) ms = me;
+        }
+        f->ms[y] = ms;
+        f->me[y] = me;
+    }
+
+    editorCaptureStatusBar(f);
+
     int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
+    if (msglen > f->screencols) msglen = f->screencols;
     //display message for 5 seconds
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    if (time(NULL) - E.statusmsg_time >= 5) msglen = 0;
+    memcpy(f->msg, E.statusmsg, msglen);
+    f->msglen = msglen;
+
+    f->cy = E.cy - E.rowoff + 1;
+    f->cx = E.rx - E.coloff + 1;
+
+    //f may still hold the keys of a frame that was never written
+    for (int j = 0; j < E.nlatkeys; j++) {
+        if (f->nkeys < KILO_LAT_KEYS) f->keys[f->nkeys++] = E.latkeys[j];
+        else E.latdropped++;
+    }
+    E.nlatkeys = 0;
 }
 
-/* editorRefreshScreen() clears the screen.
+/* editorRenderFrame() turns f into terminal output and writes it.
  * https://vt100.net/docs/vt100-ug/chapter3.html#ED
  */
-void editorRefreshScreen() {
-    editorScroll();
-
+void editorRenderFrame(frame *f) {
     //to avoid multiple consecutive writes to screen, which increases the chances of choppy reponsiveness, 
     //write everything to a buffer and then write it to screen all at once
     struct abuf ab = ABUF_INIT;
+    long long start = editorNowNs();
 
     //\x1b is the escape character (hex 27). ESC+[ is escape sequence.
     //h and l commands are the set and reset modes to turn on and off various terminal features
@@ -463,21 +5319,108 @@ void editorRefreshScreen() {
     //as written is equivalent to '<ESC>[1;1H'
     abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    long long t0 = editorTraceBegin();
+    editorDrawRows(&ab, f);
+    editorTraceEnd("editorDrawRows", t0, f->screenrows);
+    editorDrawStatusBar(&ab, f);
+    editorDrawMessageBar(&ab, f);
 
     //position the cursor in the right place as given in EditorState
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", f->cy, f->cx);
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6); //reshow the cursor
 
+    t0 = editorTraceBegin();
     write(STDOUT_FILENO, ab.b, ab.len);
+    editorTraceEnd("write", t0, ab.len);
+    __atomic_store_n(&E.perf.framens, editorNowNs() - start, __ATOMIC_RELAXED);
+    __atomic_store_n(&E.perf.framebytes, ab.len, __ATOMIC_RELAXED);
     abFree(&ab);
 }
 
+void *editorRenderThread(void *arg) {
+    renderer *r = arg;
+    editorTraceThread("render");
+
+    pthread_mutex_lock(&r->lock);
+    while (1) {
+        while (r->pending == -1 && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->stop) break;
+        r->busy = r->pending;
+        r->pending = -1;
+        pthread_mutex_unlock(&r->lock);
+
+        editorRenderFrame(&r->slot[r->busy]);
+
+        pthread_mutex_lock(&r->lock);
+        editorLatencyFrame(&r->slot[r->busy]);
+        r->shown = r->slot[r->busy].version;
+        r->busy = -1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* editorRenderStart() moves writing frames to the terminal to a thread.
+ * Without one, frames are written by editorRefreshScreen() itself.
+ */
+void editorRenderStart(void) {
+    renderer *r = calloc(1, sizeof(renderer));
+    r->pending = r->busy = -1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, editorRenderThread, r) != 0) {
+        free(r);
+        return;
+    }
+    E.render = r;
+}
+
+/* editorRenderStop() waits for the frame being written, if any, and ends
+ * the thread, so that nothing is drawn over what is written after it.
+ */
+void editorRenderStop(void) {
+    renderer *r = E.render;
+    if (!r) return;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    E.render = NULL;
+}
+
+/* editorRefreshScreen() captures the screen and hands it to the render
+ * thread in whichever slot it isn't writing, replacing a frame it hasn't
+ * picked up yet. Key handling never waits for the terminal to take a frame.
+ */
+void editorRefreshScreen() {
+    editorScroll();
+    editorHighlightDrain();
+
+    renderer *r = E.render;
+    long long t0 = editorTraceBegin();
+    if (!r) {
+        editorCapture(&E.frame);
+        editorTraceEnd("editorCapture", t0, -1);
+        E.frame.version++;
+        editorRenderFrame(&E.frame);
+        editorLatencyFrame(&E.frame);
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    int s = r->busy == 0 ? 1 : 0;
+    editorCapture(&r->slot[s]);
+    editorTraceEnd("editorCapture", t0, -1);
+    r->slot[s].version = ++r->version;
+    r->pending = s;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
 void editorSetStatusMessage(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -486,8 +5429,459 @@ void editorSetStatusMessage(const char *fmt, ...) {
     E.statusmsg_time = time(NULL);
 }
 
+/*** latency ***/
+
+//Every key is timestamped as editorReadKey() reads it and counted once the
+//first frame showing its effect has been written to the terminal. Delays go
+//into a histogram per latClass with HdrHistogram's log-linear buckets:
+//below 2^KILO_LAT_SUB_BITS microseconds one bucket per microsecond, above
+//that 2^KILO_LAT_SUB_BITS buckets per power of two, so every delay up to an
+//hour is kept to within about 3%.
+#define LAT_SUB (1 << KILO_LAT_SUB_BITS)
+#define LAT_BUCKETS ((33 - KILO_LAT_SUB_BITS) * LAT_SUB)
+
+typedef struct latHist {
+    unsigned long long count[LAT_BUCKETS];
+    unsigned long long total;
+    unsigned min, max; //microseconds
+} latHist;
+
+const char *latClassNames[LAT_CLASSES] = {"insert", "move", "page", "search", "other"};
+
+long long editorNowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int editorLatencyBucket(unsigned us) {
+    if (us < LAT_SUB) return us;
+    int shift = 31 - __builtin_clz(us) - KILO_LAT_SUB_BITS;
+    return shift * LAT_SUB + (us >> shift);
+}
+
+//The largest delay that falls into bucket b.
+unsigned editorLatencyBucketMax(int b) {
+    if (b < 2 * LAT_SUB) return b;
+    int shift = b / LAT_SUB - 1;
+    unsigned long long top = (unsigned long long)(b - shift * LAT_SUB + 1) << shift;
+    return top - 1 > UINT_MAX ? UINT_MAX : top - 1;
+}
+
+int editorLatencyClass(int c) {
+    switch (c) {
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            return LAT_MOVE;
+        case PAGE_UP:
+        case PAGE_DOWN:
+            return LAT_PAGE;
+        case CTRL_KEY('f'):
+        case CTRL_KEY('r'):
+            return LAT_SEARCH;
+        case CTRL_KEY('q'):
+        case CTRL_KEY('s'):
+        case CTRL_KEY('z'):
+        case CTRL_KEY('y'):
+        case CTRL_KEY('p'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('l'):
+        case '\x1b':
+            return LAT_OTHER;
+        default:
+            return LAT_INSERT;
+    }
+}
+
+/* editorLatencyKey() notes that the key just read has been handled, to be
+ * reported by the next frame captured.
+ */
+void editorLatencyKey(int cls) {
+    if (E.nlatkeys == KILO_LAT_KEYS) {
+        E.latdropped++;
+        return;
+    }
+    E.latkeys[E.nlatkeys].ns = E.keyns;
+    E.latkeys[E.nlatkeys].cls = cls;
+    E.nlatkeys++;
+}
+
+/* editorLatencyFrame() records the latency of the keys f reports, now that
+ * f has been written. With a render thread it runs on that thread, under
+ * the renderer's lock.
+ */
+void editorLatencyFrame(frame *f) {
+    long long now = editorNowNs();
+    for (int j = 0; j < f->nkeys; j++) {
+        latHist *h = &E.lathist[f->keys[j].cls];
+        long long us = (now - f->keys[j].ns) / 1000;
+        if (us < 0) us = 0;
+        if (us > UINT_MAX) us = UINT_MAX;
+        h->count[editorLatencyBucket(us)]++;
+        if (h->total == 0 || us < h->min) h->min = us;
+        if (us > h->max) h->max = us;
+        h->total++;
+    }
+    f->nkeys = 0;
+}
+
+unsigned editorLatencyPercentile(latHist *h, double p) {
+    double x = h->total * p / 100;
+    unsigned long long want = x;
+    if (want < x || want < 1) want++;
+    unsigned long long seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= want) {
+            unsigned v = editorLatencyBucketMax(b);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+/* editorLatencyDump() writes the histograms to path: a line of percentiles
+ * per class of key, then the buckets of each in HdrHistogram's percentile
+ * distribution format. Returns -1 with errno set on error.
+ */
+int editorLatencyDump(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+
+    renderer *r = E.render;
+    if (r) pthread_mutex_lock(&r->lock);
+    fprintf(fp, "# key to frame latency in microseconds\n");
+    for (int c = 0; c < LAT_CLASSES; c++) {
+        latHist *h = &E.lathist[c];
+        fprintf(fp, "%-6s %8llu keys", latClassNames[c], h->total);
+        if (h->total)
+            fprintf(fp, "  min %u  p50 %u  p90 %u  p99 %u  p99.9 %u  max %u",
+                    h->min, editorLatencyPercentile(h, 50),
+                    editorLatencyPercentile(h, 90), editorLatencyPercentile(h, 99),
+                    editorLatencyPercentile(h, 99.9), h->max);
+        fprintf(fp, "\n");
+    }
+    if (E.latdropped) fprintf(fp, "# %llu keys not recorded\n", E.latdropped);
+
+    for (int c = 0; c < LAT_CLASSES; c++) {
+        latHist *h = &E.lathist[c];
+        if (!h->total) continue;
+        fprintf(fp, "\n# %s\n%12s %14s %10s %14s\n",
+                latClassNames[c], "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+        unsigned long long seen = 0;
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            if (!h->count[b]) continue;
+            seen += h->count[b];
+            double q = (double)seen / h->total;
+            unsigned v = editorLatencyBucketMax(b);
+            if (v > h->max) v = h->max;
+            if (seen < h->total)
+                fprintf(fp, "%12u %14.12f %10llu %14.2f\n", v, q, seen, 1 / (1 - q));
+            else
+                fprintf(fp, "%12u %14.12f %10llu %14s\n", v, q, seen, "inf");
+        }
+    }
+    if (r) pthread_mutex_unlock(&r->lock);
+
+    int err = ferror(fp);
+    if (fclose(fp) != 0 || err) return -1;
+    return 0;
+}
+
+/*** tracing ***/
+
+//With KILO_TRACE set to a path, spans of the editor's work are kept in a
+//ring of the last KILO_TRACE_EVENTS and written there on exit as Chrome
+//trace JSON, for Perfetto or chrome://tracing. Any thread may record: a
+//slot is claimed with one atomic add. With tracing off a span costs a test
+//of E.trace at each end.
+typedef struct traceEvent {
+    const char *name;  //a string constant
+    long long ts, dur; //nanoseconds
+    long long n;       //what the span counted, or -1
+    int tid;
+} traceEvent;
+
+typedef struct trace {
+    char *path;
+    long long start;
+    struct {
+        int tid;
+        const char *name;
+    } thread[8];       //names of the threads that record
+    int nthreads;
+    unsigned next;     //events recorded so far
+    traceEvent ev[KILO_TRACE_EVENTS];
+} trace;
+
+/* editorTraceThread() names the calling thread in the trace.
+ */
+void editorTraceThread(const char *name) {
+    trace *t = E.trace;
+    if (!t) return;
+    int j = __atomic_fetch_add(&t->nthreads, 1, __ATOMIC_RELAXED);
+    if (j >= 8) return;
+    t->thread[j].tid = syscall(SYS_gettid);
+    t->thread[j].name = name;
+}
+
+/* editorTraceOpen() starts tracing to path, with the calling thread as
+ * the main one.
+ */
+void editorTraceOpen(const char *path) {
+    trace *t = calloc(1, sizeof(trace));
+    if (!t) return;
+    t->path = strdup(path);
+    t->start = editorNowNs();
+    E.trace = t;
+    editorTraceThread("main");
+}
+
+long long editorTraceBegin(void) {
+    return E.trace ? editorNowNs() : 0;
+}
+
+/* editorTraceEnd() records the span called name that editorTraceBegin()
+ * returned t0 for. n, unless -1, is shown as its count.
+ */
+void editorTraceEnd(const char *name, long long t0, long long n) {
+    trace *t = E.trace;
+    if (!t || !t0) return;
+    unsigned i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+    traceEvent *ev = &t->ev[i % KILO_TRACE_EVENTS];
+    ev->name = name;
+    ev->ts = t0 - t->start;
+    ev->dur = editorNowNs() - t0;
+    ev->n = n;
+    ev->tid = syscall(SYS_gettid);
+}
+
+/* editorTraceFlush() writes the spans in the ring to the trace file,
+ * oldest first. Called on exit once the render thread is done.
+ */
+void editorTraceFlush(void) {
+    trace *t = E.trace;
+    if (!t) return;
+    FILE *fp = fopen(t->path, "w");
+    if (!fp) return;
+
+    int pid = getpid();
+    int nthreads = t->nthreads < 8 ? t->nthreads : 8;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"kilo\"}}", pid);
+    for (int j = 0; j < nthreads; j++)
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", pid, t->thread[j].tid, t->thread[j].name);
+
+    unsigned next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+    unsigned i = next > KILO_TRACE_EVENTS ? next - KILO_TRACE_EVENTS : 0;
+    for (; i != next; i++) {
+        traceEvent *ev = &t->ev[i % KILO_TRACE_EVENTS];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f", ev->name, pid, ev->tid,
+                ev->ts / 1000.0, ev->dur / 1000.0);
+        if (ev->n >= 0) fprintf(fp, ",\"args\":{\"n\":%lld}", ev->n);
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+/*** performance overlay ***/
+
+/* editorPerfAlloc() counts an allocation made on a hot path. It may be
+ * called from any thread.
+ */
+void editorPerfAlloc(void) {
+    __atomic_add_fetch(&E.perf.allocs, 1, __ATOMIC_RELAXED);
+}
+
+/* editorPerfSample() works out the allocation rate once a second. Returns
+ * 1 if it did and the overlay shows it.
+ */
+int editorPerfSample(void) {
+    long long now = editorNowNs();
+    if (now - E.perf.sampled < 1000000000LL) return 0;
+    unsigned long long allocs = __atomic_load_n(&E.perf.allocs, __ATOMIC_RELAXED);
+    E.perf.allocrate = (allocs - E.perf.sampledallocs) * 1e9 / (now - E.perf.sampled);
+    E.perf.sampled = now;
+    E.perf.sampledallocs = allocs;
+    return E.perf.overlay;
+}
+
+void editorPerfBytes(char *buf, int size, long long n) {
+    if (n < 1024) snprintf(buf, size, "%lldB", n);
+    else if (n < (1 << 20)) snprintf(buf, size, "%.1fK", n / 1024.0);
+    else if (n < (1 << 30)) snprintf(buf, size, "%.1fM", n / 1048576.0);
+    else snprintf(buf, size, "%.1fG", n / 1073741824.0);
+}
+
+/* editorPerfStatus() writes the overlay to buf: how long the last frame took
+ * to build and write and its size, the memory held by rows and the
+ * allocation rate. Returns its length.
+ */
+int editorPerfStatus(char *buf, int size) {
+    char frame[16], rows[16];
+    editorPerfSample();
+    editorPerfBytes(frame, sizeof(frame),
+            __atomic_load_n(&E.perf.framebytes, __ATOMIC_RELAXED));
+    editorPerfBytes(rows, sizeof(rows), editorMemUsage(MEM_CHARS) +
+            editorMemUsage(MEM_RENDER) + editorMemUsage(MEM_HL) + editorMemUsage(MEM_ROWS));
+    int len = snprintf(buf, size, "frame %.2fms %s | rows %s | %u allocs/s",
+            __atomic_load_n(&E.perf.framens, __ATOMIC_RELAXED) / 1e6, frame,
+            rows, E.perf.allocrate);
+    return len < size ? len : size - 1;
+}
+
+/*** memory ***/
+
+const char *memKindNames[MEM_KINDS] = {
+    "chars", "render", "hl", "rows", "out", "undo", "index", "cold"
+};
+
+/* editorMemUsage() is the API to the memory accounting: the bytes held for
+ * kind, or in all if kind is MEM_KINDS.
+ */
+long long editorMemUsage(int kind) {
+    switch (kind) {
+        case MEM_ROWS:
+            return (long long)E.numrows * sizeof(erow);
+        case MEM_OUTPUT:
+            return __atomic_load_n(&E.mem[MEM_OUTPUT], __ATOMIC_RELAXED);
+        case MEM_UNDO:
+            return E.undo.cap;
+        case MEM_INDEX:
+            //the index being built is counted once it is adopted
+            if (!E.index || !E.index->list) return 0;
+            return E.index->bytes + (long long)E.index->nwhere * sizeof(int);
+        case MEM_KINDS:
+            {
+                long long total = 0;
+                for (int j = 0; j < MEM_KINDS; j++) total += editorMemUsage(j);
+                return total;
+            }
+        default:
+            return E.mem[kind];
+    }
+}
+
+int editorMemOver(void) {
+    return E.membudget && editorMemUsage(MEM_KINDS) > E.membudget;
+}
+
+/* editorMemEnforce() frees rendered rows away from the screen while the
+ * editor is over its memory budget, going round the buffer like a clock
+ * hand, KILO_COLD_SCAN rows per idle tick; editorCapture() renders them
+ * again when they are drawn, and highlights them again if they are
+ * frozen. After a whole round that freed nothing it waits for the usage
+ * to change. If that is not enough, frozen rows are paged out.
+ */
+void editorMemEnforce(void) {
+    if (!E.membudget) return;
+    long long used = editorMemUsage(MEM_KINDS);
+    long long over = used - E.membudget;
+    int lo = E.rowoff - E.screenrows, hi = E.rowoff + 2 * E.screenrows;
+
+    if (used == E.memstuck) over = 0;
+    for (int n = 0; n < E.numrows && n < KILO_COLD_SCAN && over > 0; n++) {
+        if (E.memhand >= E.numrows) E.memhand = 0;
+        int at = E.memhand++;
+        long long was = over;
+        erow *row = &E.row[at];
+        if (at < lo || at >= hi) {
+            //a render shared with other rows stays until they free it too
+            if (row->render && !(row->flags & (ROW_INTERNED | ROW_ALIASED)))
+                over -= row->rsize + 1;
+            if (row->cold && row->hl) over -= row->rsize + 1;
+            if (row->cold) editorColdDrop(row);
+            else editorRowFreeRender(row);
+        }
+        if (over < was) {
+            E.memidle = 0;
+        } else if (++E.memidle >= E.numrows) {
+            E.memidle = 0;
+            E.memstuck = editorMemUsage(MEM_KINDS);
+            break;
+        }
+    }
+    editorSpillEnforce();
+}
+
+/* editorMemStatus() writes the memory overlay to buf: the total against
+ * the budget, the bytes of each kind, then paging and interning if on.
+ * Returns its length.
+ */
+int editorMemStatus(char *buf, int size) {
+    char n[16];
+    int len = 0;
+    editorPerfBytes(n, sizeof(n), editorMemUsage(MEM_KINDS));
+    len += snprintf(buf + len, size - len, "%s", n);
+    if (E.membudget) {
+        editorPerfBytes(n, sizeof(n), E.membudget);
+        len += snprintf(buf + len, size - len, "/%s", n);
+    }
+    for (int j = 0; j < MEM_KINDS && len < size; j++) {
+        editorPerfBytes(n, sizeof(n), editorMemUsage(j));
+        len += snprintf(buf + len, size - len, " %s %s", memKindNames[j], n);
+    }
+    if (E.spill.fd != -1 && len < size) {
+        editorPerfBytes(n, sizeof(n), E.spill.out);
+        len += snprintf(buf + len, size - len, " | paged out %s, %lld in %lld out",
+                n, E.spill.pageins, E.spill.pageouts);
+    }
+    if (E.intern && len < size) len += editorInternStatus(buf + len, size - len);
+    return len < size ? len : size - 1;
+}
+
 /*** input ***/
 
+/* editorPrompt() reads a line of input in the message bar. prompt is a
+ * format string for the input so far. callback, if given, is called after
+ * every key with the input and the key. Returns the input, or NULL if the
+ * user pressed ESC.
+ */
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1) {
+        editorSetStatusMessage(prompt, buf);
+        editorRefreshScreen();
+
+        int c = editorReadKey();
+        editorLatencyKey(LAT_SEARCH);
+        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (c == '\x1b') {
+            editorSetStatusMessage("");
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                editorSetStatusMessage("");
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        } else if (!iscntrl(c) && c < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        if (callback) callback(buf, c);
+    }
+}
+
 void editorMoveCursor(int key) {
     erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
@@ -521,11 +5915,27 @@ void editorMoveCursor(int key) {
 
 }
 
+/* editorIdle() runs while no key is pressed. Returns 1 if the screen
+ * needs to be redrawn.
+ */
+int editorIdle(void) {
+    int redraw = editorSavePoll();
+    redraw |= editorJournalPoll();
+    redraw |= editorFindPoll();
+    redraw |= editorIndexPoll();
+    redraw |= editorHighlightPoll();
+    redraw |= editorPerfSample();
+    editorMemEnforce();
+    editorColdFreeze(KILO_COLD_IDLE, 1);
+    return redraw;
+}
+
 /* editorProcessKeypress() waits for a keypress and then handles it.
  * Role is to map keys to editor functions at a high level.
  */
 void editorProcessKeypress() {
     int c = editorReadKey();
+    editorLatencyKey(editorLatencyClass(c));
 
     switch(c) {
         case '\r':
@@ -533,12 +5943,51 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('q'):
+            editorSaveWait();
+            editorJournalClose(E.dirty != 0);
+            editorRenderStop();
+            if (getenv("KILO_LATENCY")) editorLatencyDump(getenv("KILO_LATENCY"));
+            editorTraceFlush();
             //clear screen on exit
             write(STDOUT_FILENO, "\x1b[2J",4);
             write(STDOUT_FILENO, "\x1b[H",3);
             exit(0);
             break;
 
+        case CTRL_KEY('s'):
+            editorSave();
+            break;
+
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplaceAll();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('g'):
+            E.perf.overlay = (E.perf.overlay + 1) % (ROWS_OVERLAY + 1);
+            break;
+
+        case CTRL_KEY('p'):
+            {
+                char *path = getenv("KILO_LATENCY");
+                if (!path) path = "kilo-latency.txt";
+                if (editorLatencyDump(path) == 0)
+                    editorSetStatusMessage("Key latency written to %s", path);
+                else
+                    editorSetStatusMessage("Can't write key latency: %s", strerror(errno));
+            }
+            break;
+
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -603,7 +6052,91 @@ void initEditor() {
     E.coloff=0;
     E.numrows=0;
     E.row = NULL;
+    memset(&E.rowstats, 0, sizeof(E.rowstats));
+    E.dirty = 0;
+    E.dirtyrows = NULL;
+    E.ndirtyrows = 0;
+    E.diskrows = 0;
+    E.disksize = -1;
+    E.disknl = 1;
+    E.diskcrlf = 0;
+    E.inplace = getenv("KILO_INPLACE_SAVE") != NULL;
+    E.save = NULL;
+    E.journal = NULL;
+    E.reshaped = 0;
+    E.nextrowid = 0;
+    E.index = NULL;
+    E.find.found = 0;
+    E.find.regex = 0;
+    E.find.query = NULL;
+    E.find.match = NULL;
+    E.undo.buf = NULL;
+    E.undo.len = E.undo.cap = E.undo.cur = 0;
+    E.undo.last = -1;
+    E.undo.next = 0;
+    E.undo.suspended = 0;
+    E.undo.budget = KILO_UNDO_BUDGET;
+    if (getenv("KILO_UNDO_BUDGET")) {
+        char *end;
+        errno = 0;
+        E.undo.budget = strtoll(getenv("KILO_UNDO_BUDGET"), &end, 10);
+        if (errno || end == getenv("KILO_UNDO_BUDGET") || *end || E.undo.budget < 0) {
+            errno = EINVAL;
+            die("KILO_UNDO_BUDGET (bytes)");
+        }
+    }
+    E.clock = 0;
+    E.snaps = NULL;
+    E.retired = NULL;
+    E.nretired = 0;
     E.filename = NULL;
+    E.syntax = NULL;
+    E.hljob = NULL;
+    E.hldead = NULL;
+    E.hlrestart = 0;
+    E.hldefer = 0;
+    E.render = NULL;
+    memset(&E.frame, 0, sizeof(E.frame));
+    E.keyns = 0;
+    E.nlatkeys = 0;
+    E.lathist = calloc(LAT_CLASSES, sizeof(struct latHist));
+    E.latdropped = 0;
+    E.trace = NULL;
+    memset(&E.perf, 0, sizeof(E.perf));
+    E.perf.sampled = editorNowNs();
+    memset(E.mem, 0, sizeof(E.mem));
+    E.membudget = 0;
+    if (getenv("KILO_MEM_BUDGET")) {
+        char *end;
+        errno = 0;
+        E.membudget = strtoll(getenv("KILO_MEM_BUDGET"), &end, 10);
+        if (errno || end == getenv("KILO_MEM_BUDGET") || *end || E.membudget < 0) {
+            errno = EINVAL;
+            die("KILO_MEM_BUDGET (bytes)");
+        }
+    }
+    E.memhand = 0;
+    E.memidle = 0;
+    E.memstuck = -1;
+    E.coldon = getenv("KILO_COLD") != NULL;
+    E.coldhand = 0;
+    E.coldidle = 0;
+    E.coldrowoff = 0;
+    E.coldclean = 0;
+    E.coldserial = 0;
+    memset(&E.coldcache, 0, sizeof(E.coldcache));
+    E.coldcache.pagein = 1;
+    memset(&E.spill, 0, sizeof(E.spill));
+    E.spill.fd = -1;
+    E.intern = NULL;
+    if (getenv("KILO_INTERN")) {
+        E.intern = calloc(1, sizeof(internTable));
+        E.intern->mask = 1023;
+        E.intern->bucket = calloc(E.intern->mask + 1, sizeof(internEntry *));
+        E.intern->bytes = (E.intern->mask + 1) * sizeof(internEntry *);
+        E.mem[MEM_CHARS] += E.intern->bytes;
+    }
+    if (getenv("KILO_TRACE")) editorTraceOpen(getenv("KILO_TRACE"));
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
 
@@ -616,11 +6149,13 @@ int main (int argc, char *argv[]) {
     enableRawMode();
     initEditor();
     
+    //set before opening so messages about recovered edits take precedence
+    editorSetStatusMessage("HELP: ^S save | ^F find | ^R replace | ^Z/^Y undo/redo | ^Q quit");
+
     if (argc >= 2) {
         editorOpen(argv[1]);
     }
-
-    editorSetStatusMessage("HELP: Ctrl-Q to quite");
+    editorRenderStart();
     
     while (1) {
         editorRefreshScreen();